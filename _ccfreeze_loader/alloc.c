@@ -0,0 +1,118 @@
+// memory allocator setup, see alloc.h
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include "alloc.h"
+#include "options.h"
+
+#define MIB (1024L * 1024L)
+
+// glibc's default
+#define DEFAULT_TOP_PAD (128L * 1024L)
+
+static int startup = 0;
+
+void ccf_alloc_setup(void)
+{
+	const char *allocator = ccf_option("allocator");
+
+	if (!allocator) {
+		return;
+	}
+#ifdef M_TOP_PAD
+	if (strcmp(allocator, "arena") == 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+		mallopt(M_ARENA_MAX, ccf_option_long("arena_max", cpus > 0 ? cpus : 1));
+		mallopt(M_MMAP_THRESHOLD, ccf_option_long("mmap_threshold", 64 * MIB));
+		// never shrink the heap
+		mallopt(M_TRIM_THRESHOLD, -1);
+		mallopt(M_TOP_PAD, ccf_option_long("top_pad", 16 * MIB));
+	} else if (strcmp(allocator, "startup") == 0) {
+		// large requests stay in the heap too
+		mallopt(M_MMAP_THRESHOLD, 32 * MIB);
+		mallopt(M_TOP_PAD, ccf_option_long("startup_arena", 64 * MIB));
+		startup = 1;
+	}
+#endif
+}
+
+void ccf_alloc_startup_done(void)
+{
+	if (!startup) {
+		return;
+	}
+	startup = 0;
+#ifdef M_TOP_PAD
+	mallopt(M_TOP_PAD, DEFAULT_TOP_PAD);
+	malloc_trim(0);
+#endif
+}
+
+int ccf_alloc_info(struct ccf_alloc_info *info)
+{
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 33)
+	struct mallinfo2 mi = mallinfo2();
+
+	info->heap_bytes = mi.arena;
+	info->mmap_bytes = mi.hblkhd;
+	info->mmap_blocks = mi.hblks;
+	info->used_bytes = mi.uordblks;
+	info->free_bytes = mi.fordblks;
+	info->free_blocks = mi.ordblks;
+	info->releasable_bytes = mi.keepcost;
+	return 1;
+#else
+	memset(info, 0, sizeof(*info));
+	return 0;
+#endif
+}
+
+int ccf_memory_info(struct ccf_memory_info *info)
+{
+	static const struct {
+		const char *name;
+		size_t offset;
+	} fields[] = {
+		{"Rss:", offsetof(struct ccf_memory_info, rss)},
+		{"Pss:", offsetof(struct ccf_memory_info, pss)},
+		{"Shared_Clean:", offsetof(struct ccf_memory_info, shared_clean)},
+		{"Shared_Dirty:", offsetof(struct ccf_memory_info, shared_dirty)},
+		{"Private_Clean:", offsetof(struct ccf_memory_info, private_clean)},
+		{"Private_Dirty:", offsetof(struct ccf_memory_info, private_dirty)},
+		{"Swap:", offsetof(struct ccf_memory_info, swap)},
+	};
+	char line[256];
+	size_t i, len;
+	FILE *f;
+
+	memset(info, 0, sizeof(*info));
+	// one summary instead of a block per mapping, since Linux 4.14
+	f = fopen("/proc/self/smaps_rollup", "r");
+	if (!f) {
+		f = fopen("/proc/self/smaps", "r");
+	}
+	if (!f) {
+		return 0;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		for (i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+			len = strlen(fields[i].name);
+			if (strncmp(line, fields[i].name, len) == 0) {
+				*(size_t *)((char *)info + fields[i].offset) +=
+					strtoul(line + len, 0, 10) * 1024;
+				break;
+			}
+		}
+	}
+	fclose(f);
+	return 1;
+}
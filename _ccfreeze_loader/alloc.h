@@ -0,0 +1,69 @@
+// memory allocator setup
+//
+// Python 2 gets its memory from malloc(), but for the pymalloc arenas that
+// hold small objects. The freeze-time option allocator tunes glibc's
+// malloc before Py_Initialize:
+//
+//	system	leave it alone, the default
+//	arena	keep freed memory in the per-thread arenas and their caches
+//		instead of giving it back to the system: at most arena_max
+//		arenas (default: the number of CPUs), blocks below
+//		mmap_threshold bytes (default 64 MiB) come from the arenas,
+//		which grow by top_pad bytes (default 16 MiB) at a time
+//	startup	grow the heap by startup_arena bytes (default 64 MiB) at a
+//		time while the program starts, so that its allocations are
+//		cut off the top of a few large blocks, and give the unused
+//		part back once startup is done
+//
+// Startup is done when the program calls _ccfreeze.startup_done() or
+// os.fork(), or when a zygote starts serving.
+//
+// Python 2 has no PyMem_SetAllocator() and no allocator domains: PyMem_*
+// calls malloc() directly and PyObject_* takes its arenas from malloc(),
+// so there is nothing to count per domain without a debug build. The
+// startup report has the counters of the malloc heap as a whole instead
+// (see ccf_alloc_info), and those of the process' pages (see
+// ccf_memory_info), when __main__ finished. _ccfreeze.malloc_info() and
+// _ccfreeze.memory_info() return them as dicts.
+
+#ifndef CCFREEZE_ALLOC_H
+#define CCFREEZE_ALLOC_H
+
+#include <stddef.h>
+
+struct ccf_alloc_info {
+	size_t heap_bytes;	// obtained with brk()/sbrk()
+	size_t mmap_bytes;	// in blocks mmap()ed one by one
+	size_t mmap_blocks;
+	size_t used_bytes;	// in use, mmap()ed blocks excluded
+	size_t free_bytes;
+	size_t free_blocks;
+	size_t releasable_bytes;	// at the top of the heap
+};
+
+// pages of the process by how they are shared, in bytes, from
+// /proc/self/smaps. A child forked after startup has most of its pages in
+// shared_*, the writes that copied them are in private_dirty.
+struct ccf_memory_info {
+	size_t rss;
+	size_t pss;		// rss, shared pages divided among their users
+	size_t shared_clean;
+	size_t shared_dirty;
+	size_t private_clean;
+	size_t private_dirty;
+	size_t swap;
+};
+
+// apply the allocator option, before Py_Initialize
+void ccf_alloc_setup(void);
+
+// end of the startup arena, if there is one
+void ccf_alloc_startup_done(void);
+
+// returns 0 if this C library has no counters
+int ccf_alloc_info(struct ccf_alloc_info *info);
+
+// returns 0 if there is no /proc/self/smaps
+int ccf_memory_info(struct ccf_memory_info *info);
+
+#endif
@@ -0,0 +1,797 @@
+// mmap-backed, read-only access to the library archive
+
+#include <Python.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#ifdef WITH_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef WITH_ZSTD
+#include <zstd.h>
+#endif
+
+#ifdef WITH_LZ4
+#include <limits.h>
+#include <lz4.h>
+#endif
+
+#include "archive.h"
+#include "options.h"
+
+#define EOCD_SIZE 22
+#define CDIR_SIZE 46
+#define LOCAL_SIZE 30
+
+static unsigned int get16(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static unsigned int get32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+static unsigned long long get64(const unsigned char *p)
+{
+	return get32(p) | ((unsigned long long)get32(p + 4) << 32);
+}
+
+static unsigned int crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void make_crc_table(void)
+{
+	unsigned int i, k, c;
+
+	for (i = 0; i < 256; i++) {
+		c = i;
+		for (k = 0; k < 8; k++) {
+			c = (c & 1) ? 0xedb88320U ^ (c >> 1) : c >> 1;
+		}
+		crc_table[i] = c;
+	}
+}
+
+unsigned int ccf_crc32(unsigned int crc, const unsigned char *p, size_t len)
+{
+	const unsigned int *table = crc_table;
+
+	pthread_once(&crc_once, make_crc_table);
+	crc = ~crc;
+	while (len--) {
+		crc = table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	}
+	return ~crc;
+}
+
+static unsigned int hash_name(const char *name, size_t len, unsigned int seed)
+{
+	// FNV-1a, with the murmur3 finalizer: names differing only in their
+	// last characters hash to neighbouring values otherwise
+	unsigned int h = 2166136261U ^ seed;
+	while (len--) {
+		h ^= (unsigned char)*name++;
+		h *= 16777619U;
+	}
+	h ^= h >> 16;
+	h *= 0x85ebca6bU;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35U;
+	h ^= h >> 16;
+	return h;
+}
+
+static const unsigned char *find_eocd(const unsigned char *map, size_t size)
+{
+	const unsigned char *p, *stop;
+
+	if (size < EOCD_SIZE) {
+		return 0;
+	}
+	// the end of central directory record is followed by a comment of at
+	// most 64k
+	stop = size > EOCD_SIZE + 0xffff ? map + size - EOCD_SIZE - 0xffff : map;
+	for (p = map + size - EOCD_SIZE; p >= stop; --p) {
+		if (p[0] == 'P' && p[1] == 'K' && p[2] == 5 && p[3] == 6) {
+			return p;
+		}
+	}
+	return 0;
+}
+
+#define INDEX_HEADER_SIZE 32
+#define INDEX_RECORD_SIZE 32
+#define PACK_HEADER_SIZE 32
+
+// validate a module index of size bytes for an archive of entries members
+static const unsigned char *check_index(const unsigned char *index, size_t size,
+					unsigned int entries)
+{
+	unsigned int count, nbuckets;
+
+	if (size < INDEX_HEADER_SIZE
+	    || memcmp(index, CCF_INDEX_MAGIC, 8) != 0
+	    || get32(index + 8) != CCF_INDEX_VERSION
+	    || get32(index + 20) != entries) {
+		return 0;
+	}
+	count = get32(index + 12);
+	nbuckets = get32(index + 16);
+	if (!count || !nbuckets
+	    || INDEX_HEADER_SIZE + 4 * (size_t)nbuckets + INDEX_RECORD_SIZE * (size_t)count > size) {
+		return 0;
+	}
+	return index;
+}
+
+// use the module index if the zip comment points to a valid one
+static void load_zip_index(struct ccf_archive *ar, const unsigned char *eocd)
+{
+	const unsigned char *p, *index;
+	size_t offset, size, name_len;
+
+	// the comment length can't be trusted to be within the mapping
+	if (get16(eocd + 20) < 12 || (size_t)(ar->base + ar->size - eocd) < EOCD_SIZE + 12
+	    || memcmp(eocd + EOCD_SIZE, CCF_INDEX_MAGIC, 8) != 0) {
+		return;
+	}
+	offset = ar->arc_offset + get32(eocd + EOCD_SIZE + 8);
+	if (offset + LOCAL_SIZE > (size_t)(eocd - ar->base)) {
+		return;
+	}
+	p = ar->base + offset;
+	name_len = get16(p + 26);
+	if (get32(p) != 0x04034b50 || get16(p + 8) != CCF_STORED
+	    || name_len != strlen(CCF_INDEX_NAME)
+	    || memcmp(p + LOCAL_SIZE, CCF_INDEX_NAME, name_len) != 0) {
+		return;
+	}
+	index = p + LOCAL_SIZE + name_len + get16(p + 28);
+	size = get32(p + 18);
+	if (index > eocd || size > (size_t)(eocd - index)) {
+		return;
+	}
+	ar->index = check_index(index, size, get16(eocd + 10));
+	ar->index_size = size;
+}
+
+// index and pack table records:
+//
+// u32 key, u16 key_len, u16 flags, u32 name, u16 name_len, u16 method,
+// u32 csize, u32 usize, u32 crc, u32 data offset
+//
+// key and name are offsets relative to strings
+static int read_record(const struct ccf_archive *ar, const unsigned char *rec,
+		       const unsigned char *strings, size_t strings_size,
+		       struct ccf_entry *e, int *flags)
+{
+	size_t name = get32(rec + 8);
+
+	memset(e, 0, sizeof(*e));
+	e->name_len = get16(rec + 12);
+	if (name + e->name_len > strings_size) {
+		return -1;
+	}
+	e->name = (const char *)strings + name;
+	e->method = get16(rec + 14);
+	e->csize = get32(rec + 16);
+	e->usize = get32(rec + 20);
+	e->crc = get32(rec + 24);
+	e->data_offset = ar->arc_offset + get32(rec + 28);
+	if (flags) {
+		*flags = get16(rec + 6);
+	}
+	return 0;
+}
+
+int ccf_archive_find_module(const struct ccf_archive *ar, const char *fullname,
+			    size_t len, struct ccf_entry *e, int *flags)
+{
+	const unsigned char *idx = ar->index, *rec;
+	unsigned int count, nbuckets, d;
+	size_t key;
+
+	if (!idx) {
+		return -1;
+	}
+	count = get32(idx + 12);
+	nbuckets = get32(idx + 16);
+	d = get32(idx + INDEX_HEADER_SIZE + 4 * (hash_name(fullname, len, 0) % nbuckets));
+	rec = idx + INDEX_HEADER_SIZE + 4 * (size_t)nbuckets
+		+ INDEX_RECORD_SIZE * (size_t)(hash_name(fullname, len, d) % count);
+
+	key = get32(rec);
+	if (get16(rec + 4) != len || key + len > ar->index_size
+	    || memcmp(idx + key, fullname, len) != 0) {
+		return 0;
+	}
+	return read_record(ar, rec, idx, ar->index_size, e, flags) == 0;
+}
+
+// fill entries from the zip central directory
+static int read_zip_entries(struct ccf_archive *ar, struct ccf_entry *entries,
+			    unsigned int count)
+{
+	const unsigned char *eocd, *p;
+	unsigned int i;
+
+	eocd = find_eocd(ar->base, ar->size);
+	p = ar->base + ar->arc_offset + get32(eocd + 16);
+	for (i = 0; i < count; i++) {
+		struct ccf_entry *e = &entries[i];
+
+		if (p + CDIR_SIZE > eocd || get32(p) != 0x02014b50) {
+			return -1;
+		}
+		e->method = get16(p + 10);
+		e->crc = get32(p + 16);
+		e->csize = get32(p + 20);
+		e->usize = get32(p + 24);
+		e->name_len = get16(p + 28);
+		e->header_offset = ar->arc_offset + get32(p + 42);
+		e->name = (const char *)p + CDIR_SIZE;
+		if (p + CDIR_SIZE + e->name_len > eocd
+		    || e->header_offset + LOCAL_SIZE > ar->size) {
+			return -1;
+		}
+		p += CDIR_SIZE + e->name_len + get16(p + 30) + get16(p + 32);
+	}
+	return 0;
+}
+
+// fill entries from the table of a pack file
+static int read_pack_entries(struct ccf_archive *ar, struct ccf_entry *entries,
+			     unsigned int count)
+{
+	const unsigned char *table = ar->base + get32(ar->base + 16);
+	size_t meta_size = get32(ar->base + 28);
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		if (read_record(ar, table + INDEX_RECORD_SIZE * (size_t)i, ar->base, meta_size,
+				&entries[i], 0) != 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int build_toc(struct ccf_archive *ar)
+{
+	struct ccf_entry *entries;
+	unsigned int *table;
+	size_t tabsize, mask;
+	unsigned int i, count;
+	int err;
+
+	if (ar->pack) {
+		count = get32(ar->base + 12);
+	} else {
+		count = get16(find_eocd(ar->base, ar->size) + 10);
+	}
+
+	for (tabsize = 16; tabsize < 2 * (size_t)count; tabsize <<= 1)
+		;
+	mask = tabsize - 1;
+	entries = calloc(count ? count : 1, sizeof(struct ccf_entry));
+	table = calloc(tabsize, sizeof(unsigned int));
+	if (!entries || !table) {
+		goto error;
+	}
+	if (ar->pack) {
+		err = read_pack_entries(ar, entries, count);
+	} else {
+		err = read_zip_entries(ar, entries, count);
+	}
+	if (err != 0) {
+		goto error;
+	}
+
+	for (i = 0; i < count; i++) {
+		const struct ccf_entry *e = &entries[i];
+		unsigned int h = hash_name(e->name, e->name_len, 0) & mask;
+
+		// later entries with the same name win, like zipimport
+		while (table[h]) {
+			const struct ccf_entry *o = &entries[table[h] - 1];
+			if (o->name_len == e->name_len && memcmp(o->name, e->name, e->name_len) == 0) {
+				break;
+			}
+			h = (h + 1) & mask;
+		}
+		table[h] = i + 1;
+	}
+	ar->entries = entries;
+	ar->table = table;
+	ar->mask = mask;
+	ar->count = count;
+	return 0;
+
+error:
+	free(entries);
+	free(table);
+	return -1;
+}
+
+static int read_zip(struct ccf_archive *ar)
+{
+	const unsigned char *eocd = find_eocd(ar->base, ar->size);
+	size_t cd_size, cd_offset;
+
+	if (!eocd) {
+		return -1;
+	}
+	cd_size = get32(eocd + 12);
+	cd_offset = get32(eocd + 16);
+
+	// data may have been prepended to the archive (e.g. an executable),
+	// in which case all stored offsets are relative to arc_offset
+	if ((size_t)(eocd - ar->base) < cd_size + cd_offset) {
+		return -1;
+	}
+	ar->arc_offset = (eocd - ar->base) - cd_size - cd_offset;
+
+	load_zip_index(ar, eocd);
+	if (!ar->index) {
+		return build_toc(ar);
+	}
+	return 0;
+}
+
+static int is_pack(const struct ccf_archive *ar)
+{
+	return ar->size >= PACK_HEADER_SIZE && memcmp(ar->base, CCF_PACK_MAGIC, 8) == 0;
+}
+
+static int read_pack(struct ccf_archive *ar)
+{
+	const unsigned char *h = ar->base;
+	size_t count = get32(h + 12), table = get32(h + 16), index = get32(h + 20);
+	size_t index_size = get32(h + 24), meta_size = get32(h + 28);
+
+	if (get32(h + 8) != CCF_PACK_VERSION || meta_size > ar->size
+	    || table + INDEX_RECORD_SIZE * count > meta_size
+	    || index + index_size > meta_size) {
+		return -1;
+	}
+	ar->pack = 1;
+	if (index) {
+		ar->index = check_index(ar->base + index, index_size, count);
+		ar->index_size = index_size;
+	}
+	if (!ar->index) {
+		return build_toc(ar);
+	}
+	return 0;
+}
+
+struct ccf_archive *ccf_loader_archive = 0;
+
+// returns 1 and fills offset/size/checksum if the file ends with a trailer
+static int read_trailer(int fd, size_t file_size, size_t *offset, size_t *size,
+			unsigned int *checksum)
+{
+	unsigned char t[CCF_TRAILER_SIZE];
+	unsigned long long o, n;
+
+	if (file_size < CCF_TRAILER_SIZE
+	    || pread(fd, t, CCF_TRAILER_SIZE, file_size - CCF_TRAILER_SIZE) != CCF_TRAILER_SIZE
+	    || memcmp(t + 24, CCF_TRAILER_MAGIC, 8) != 0
+	    || get32(t + 20) != CCF_TRAILER_VERSION) {
+		return 0;
+	}
+	o = get64(t);
+	n = get64(t + 8);
+	if (o > file_size - CCF_TRAILER_SIZE || n > file_size - CCF_TRAILER_SIZE - o) {
+		return 0;
+	}
+	*offset = o;
+	*size = n;
+	*checksum = get32(t + 16);
+	return 1;
+}
+
+// the trailer checksum covers what the table of contents is built from:
+// everything from the central directory on, or a pack file's metadata.
+// Returns 0 if ar has neither.
+static int get_checksum(const struct ccf_archive *ar, unsigned int *checksum)
+{
+	const unsigned char *eocd;
+	size_t cd_size;
+
+	if (is_pack(ar)) {
+		size_t meta_size = get32(ar->base + 28);
+		if (meta_size > ar->size) {
+			return 0;
+		}
+		*checksum = ccf_crc32(0, ar->base, meta_size);
+		return 1;
+	}
+	eocd = find_eocd(ar->base, ar->size);
+	if (!eocd) {
+		return 0;
+	}
+	cd_size = get32(eocd + 12);
+	if ((size_t)(eocd - ar->base) < cd_size) {
+		return 0;
+	}
+	*checksum = ccf_crc32(0, eocd - cd_size, ar->base + ar->size - (eocd - cd_size));
+	return 1;
+}
+
+static int verify_checksum(const struct ccf_archive *ar, unsigned int checksum)
+{
+	unsigned int actual;
+
+	return get_checksum(ar, &actual) && actual == checksum;
+}
+
+unsigned int ccf_archive_checksum(const struct ccf_archive *ar)
+{
+	unsigned int checksum = 0;
+
+	get_checksum(ar, &checksum);
+	return checksum;
+}
+
+// digested once here, the prefetch workers share it
+static void load_dict(struct ccf_archive *ar)
+{
+	struct ccf_entry e;
+
+	if (!ccf_archive_find_meta(ar, CCF_DICT_NAME, &e) || e.method != CCF_STORED) {
+		return;
+	}
+	ar->dict = ccf_entry_raw(ar, &e);
+	ar->dict_size = ar->dict ? e.usize : 0;
+#ifdef WITH_ZSTD
+	if (ar->dict) {
+		ar->ddict = ZSTD_createDDict(ar->dict, ar->dict_size);
+	}
+#endif
+}
+
+// pack.py compress names the method in the options: an archive this build
+// can't decompress fails here, not on the first import of a member
+static void check_method(struct ccf_archive *ar)
+{
+	static const char key[] = "compression=";
+	const unsigned char *data;
+	const char *p, *end, *eol;
+	struct ccf_entry e;
+	void *owned;
+	size_t len;
+
+	if (!ccf_archive_find_meta(ar, CCF_OPTIONS_NAME, &e)
+	    || ccf_entry_read(ar, &e, &data, &owned) != 0) {
+		return;
+	}
+	end = (const char *)data + e.usize;
+	for (p = (const char *)data; p < end; p = eol + 1) {
+		eol = memchr(p, '\n', end - p);
+		if (!eol) {
+			eol = end;
+		}
+		if ((size_t)(eol - p) < sizeof(key) - 1 || memcmp(p, key, sizeof(key) - 1) != 0) {
+			continue;
+		}
+		p += sizeof(key) - 1;
+		len = eol - p;
+		while (len && (p[len - 1] == '\r' || p[len - 1] == ' ')) {
+			len--;
+		}
+#ifdef WITH_ZSTD
+		if (len == 4 && memcmp(p, "zstd", 4) == 0) {
+			continue;
+		}
+#endif
+#ifdef WITH_LZ4
+		if (len == 3 && memcmp(p, "lz4", 3) == 0) {
+			continue;
+		}
+#endif
+		fprintf(stderr, "Fatal error: %s is compressed with %.*s, "
+			"which this loader was built without\n", ar->path, (int)len, p);
+		exit(1);
+	}
+	free(owned);
+}
+
+static struct ccf_archive *open_archive(const char *path, int payload_only)
+{
+	struct ccf_archive *ar;
+	struct stat st;
+	size_t offset = 0, size;
+	unsigned int checksum = 0;
+	int payload;
+	void *map;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return 0;
+	}
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		close(fd);
+		return 0;
+	}
+	size = st.st_size;
+	payload = read_trailer(fd, st.st_size, &offset, &size, &checksum);
+	if (!payload && payload_only) {
+		close(fd);
+		return 0;
+	}
+	map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		return 0;
+	}
+
+	ar = calloc(1, sizeof(struct ccf_archive));
+	if (!ar) {
+		munmap(map, st.st_size);
+		return 0;
+	}
+	ar->map = map;
+	ar->map_size = st.st_size;
+	ar->base = ar->map + offset;
+	ar->size = size;
+	ar->path = strdup(path);
+	if (!ar->path || (payload && !verify_checksum(ar, checksum))
+	    || (is_pack(ar) ? read_pack(ar) : read_zip(ar)) != 0) {
+		ccf_archive_close(ar);
+		return 0;
+	}
+	load_dict(ar);
+	check_method(ar);
+	return ar;
+}
+
+struct ccf_archive *ccf_archive_open(const char *path)
+{
+	return open_archive(path, 0);
+}
+
+struct ccf_archive *ccf_payload_open(const char *path)
+{
+	return open_archive(path, 1);
+}
+
+void ccf_archive_close(struct ccf_archive *ar)
+{
+	if (!ar) {
+		return;
+	}
+	if (ar->map) {
+		munmap((void *)ar->map, ar->map_size);
+	}
+#ifdef WITH_ZSTD
+	ZSTD_freeDDict(ar->ddict);
+#endif
+	free(ar->entries);
+	free(ar->table);
+	free(ar->path);
+	free(ar);
+}
+
+const struct ccf_entry *ccf_archive_find(struct ccf_archive *ar,
+					 const char *name, size_t len)
+{
+	unsigned int h;
+
+	if (!ar->table && build_toc(ar) != 0) {
+		return 0;
+	}
+	h = hash_name(name, len, 0) & ar->mask;
+
+	while (ar->table[h]) {
+		const struct ccf_entry *e = &ar->entries[ar->table[h] - 1];
+		if (e->name_len == len && memcmp(e->name, name, len) == 0) {
+			return e;
+		}
+		h = (h + 1) & ar->mask;
+	}
+	return 0;
+}
+
+int ccf_archive_find_meta(struct ccf_archive *ar, const char *name, struct ccf_entry *e)
+{
+	const struct ccf_entry *found;
+	size_t len = strlen(name);
+
+	switch (ccf_archive_find_module(ar, name, len, e, 0)) {
+	case 1:
+		return 1;
+	case 0:
+		return 0;
+	}
+	found = ccf_archive_find(ar, name, len);
+	if (!found) {
+		return 0;
+	}
+	*e = *found;
+	return 1;
+}
+
+void ccf_archive_readahead(struct ccf_archive *ar)
+{
+#ifdef MADV_WILLNEED
+	struct ccf_entry e;
+	size_t start, end;
+	long page = sysconf(_SC_PAGESIZE);
+
+	if (!ar || !ccf_archive_find_meta(ar, CCF_READAHEAD_NAME, &e) || page <= 0) {
+		return;
+	}
+	end = e.data_offset ? e.data_offset : e.header_offset;
+	if (end > ar->size) {
+		return;
+	}
+	start = (ar->base - ar->map) & ~(size_t)(page - 1);
+	end += ar->base - ar->map;
+	// starts reading and returns, the import of a member that has not been
+	// read yet blocks on its page fault as before
+	madvise((void *)(ar->map + start), end - start, MADV_WILLNEED);
+#endif
+}
+
+const unsigned char *ccf_entry_raw(const struct ccf_archive *ar,
+				   const struct ccf_entry *e)
+{
+	const unsigned char *p = ar->base + e->header_offset;
+	size_t start;
+
+	if (e->data_offset) {
+		if (e->data_offset > ar->size || ar->size - e->data_offset < e->csize) {
+			return 0;
+		}
+		return ar->base + e->data_offset;
+	}
+	if (get32(p) != 0x04034b50) {
+		return 0;
+	}
+	start = e->header_offset + LOCAL_SIZE + get16(p + 26) + get16(p + 28);
+	if (start > ar->size || ar->size - start < e->csize) {
+		return 0;
+	}
+	return ar->base + start;
+}
+
+#ifdef WITH_ZLIB
+static int inflate_entry(const struct ccf_entry *e, const unsigned char *raw,
+			 unsigned char *buf)
+{
+	z_stream zs;
+	int err;
+
+	memset(&zs, 0, sizeof(zs));
+	zs.next_in = (Bytef *)raw;
+	zs.avail_in = e->csize;
+	zs.next_out = buf;
+	zs.avail_out = e->usize;
+	if (inflateInit2(&zs, -MAX_WBITS) != Z_OK) {
+		return -1;
+	}
+	err = inflate(&zs, Z_FINISH);
+	inflateEnd(&zs);
+	return err == Z_STREAM_END && zs.total_out == e->usize ? 0 : -1;
+}
+#endif
+
+#ifdef WITH_ZSTD
+// a decompression context per thread
+static pthread_key_t dctx_key;
+static pthread_once_t dctx_once = PTHREAD_ONCE_INIT;
+
+static void free_dctx(void *dctx)
+{
+	ZSTD_freeDCtx(dctx);
+}
+
+static void create_dctx_key(void)
+{
+	pthread_key_create(&dctx_key, free_dctx);
+}
+
+static int zstd_entry(const struct ccf_archive *ar, const struct ccf_entry *e,
+		      const unsigned char *raw, unsigned char *buf)
+{
+	ZSTD_DCtx *dctx;
+	size_t n;
+
+	pthread_once(&dctx_once, create_dctx_key);
+	dctx = pthread_getspecific(dctx_key);
+	if (!dctx) {
+		dctx = ZSTD_createDCtx();
+		if (!dctx) {
+			return -1;
+		}
+		pthread_setspecific(dctx_key, dctx);
+	}
+	if (ar->ddict) {
+		n = ZSTD_decompress_usingDDict(dctx, buf, e->usize, raw, e->csize, ar->ddict);
+	} else {
+		n = ZSTD_decompressDCtx(dctx, buf, e->usize, raw, e->csize);
+	}
+	return !ZSTD_isError(n) && n == e->usize ? 0 : -1;
+}
+#endif
+
+#ifdef WITH_LZ4
+static int lz4_entry(const struct ccf_archive *ar, const struct ccf_entry *e,
+		     const unsigned char *raw, unsigned char *buf)
+{
+	const char *dict = (const char *)ar->dict;
+	size_t dict_size = ar->dict_size;
+
+	if (e->csize > INT_MAX || e->usize > INT_MAX) {
+		return -1;
+	}
+	if (dict_size > 65536) {
+		dict += dict_size - 65536;
+		dict_size = 65536;
+	}
+	return LZ4_decompress_safe_usingDict((const char *)raw, (char *)buf, (int)e->csize,
+					     (int)e->usize, dict, (int)dict_size)
+		== (int)e->usize ? 0 : -1;
+}
+#endif
+
+static int decompress(const struct ccf_archive *ar, const struct ccf_entry *e,
+		      const unsigned char *raw, unsigned char *buf)
+{
+	switch (e->method) {
+#ifdef WITH_ZLIB
+	case CCF_DEFLATED:
+		return inflate_entry(e, raw, buf);
+#endif
+#ifdef WITH_ZSTD
+	case CCF_ZSTD:
+		return zstd_entry(ar, e, raw, buf);
+#endif
+#ifdef WITH_LZ4
+	case CCF_LZ4:
+		return lz4_entry(ar, e, raw, buf);
+#endif
+	}
+	return -1;
+}
+
+int ccf_entry_read(const struct ccf_archive *ar, const struct ccf_entry *e,
+		   const unsigned char **data, void **owned)
+{
+	const unsigned char *raw = ccf_entry_raw(ar, e);
+	unsigned char *buf;
+
+	*data = 0;
+	*owned = 0;
+	if (!raw) {
+		return -1;
+	}
+	if (e->method == CCF_STORED) {
+		*data = raw;
+		return 0;
+	}
+	buf = malloc(e->usize ? e->usize : 1);
+	if (!buf) {
+		return -1;
+	}
+	if (decompress(ar, e, raw, buf) != 0) {
+		free(buf);
+		return -1;
+	}
+	*data = buf;
+	*owned = buf;
+	return 0;
+}
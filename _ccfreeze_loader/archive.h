@@ -0,0 +1,162 @@
+// mmap-backed, read-only access to the library archive
+//
+// Nothing in here touches Python objects, so it can be used before
+// Py_Initialize and without holding the GIL.
+
+#ifndef CCFREEZE_ARCHIVE_H
+#define CCFREEZE_ARCHIVE_H
+
+#include <stddef.h>
+
+// a single-file executable carries the archive appended to the loader,
+// followed by this trailer (all fields little endian):
+//
+//	u64 offset	start of the archive in the file
+//	u64 size	size of the archive
+//	u32 checksum	crc32 of the archive's central directory and end record,
+//			or of the metadata of a pack file
+//	u32 version	CCF_TRAILER_VERSION
+//	char magic[8]	CCF_TRAILER_MAGIC
+#define CCF_TRAILER_SIZE 32
+#define CCF_TRAILER_VERSION 1
+#define CCF_TRAILER_MAGIC "CCFREEZE"
+
+// pack.py can store a minimal perfect hash from module name to entry as
+// the stored member CCF_INDEX_NAME. The zip comment then starts with
+// CCF_INDEX_MAGIC followed by the u32 offset of that member's local header,
+// so the loader finds it without reading the central directory.
+//
+//	char magic[8]	CCF_INDEX_MAGIC
+//	u32 version	CCF_INDEX_VERSION
+//	u32 count	number of records
+//	u32 nbuckets	number of displacements
+//	u32 cd_entries	entries in the archive, the index is stale otherwise
+//	u32 reserved[2]
+//	u32 disp[nbuckets]
+//	record[count]	32 bytes each, see ccf_archive_find_module()
+//	strings
+//
+// A module name hashes into disp[hash(name, 0) % nbuckets] = d, its record
+// is hash(name, d) % count. hash is FNV-1a with d xor'ed into the basis,
+// followed by the murmur3 finalizer.
+// The members below .ccfreeze/ are indexed by their file name.
+#define CCF_INDEX_NAME ".ccfreeze/index"
+#define CCF_INDEX_MAGIC "CCFINDEX"
+#define CCF_INDEX_VERSION 4
+
+// record flags, the module is ...
+#define CCF_INDEX_BYTECODE 0x1
+#define CCF_INDEX_PACKAGE 0x2
+#define CCF_INDEX_EXTENSION 0x4	// a shared object, see extension.h
+
+// Instead of a zip file, the archive can be a pack file written by
+// pack.py: every member is stored uncompressed at an aligned offset (the
+// page size by default), so code objects are unmarshalled straight from the
+// mapping when their module is first imported.
+//
+//	char magic[8]	CCF_PACK_MAGIC
+//	u32 version	CCF_PACK_VERSION
+//	u32 count	number of members
+//	u32 table	offset of count records, laid out like index records
+//	u32 index	offset of a module index, 0 if there is none
+//	u32 index_size
+//	u32 meta_size	size of everything before the first member's data
+#define CCF_PACK_MAGIC "CCFPACK\x01"
+#define CCF_PACK_VERSION 1
+
+// pack.py reorder moves the members a program reads at startup to the
+// front of the archive and puts the empty member CCF_READAHEAD_NAME after
+// them.
+#define CCF_READAHEAD_NAME ".ccfreeze/readahead"
+
+// compression methods as stored in the zip central directory
+#define CCF_STORED 0
+#define CCF_DEFLATED 8
+#define CCF_ZSTD 93
+#define CCF_LZ4 0x4c34	// 'L4', not assigned by the zip specification
+
+// pack.py compress stores the dictionary its zstd and LZ4 members were
+// compressed with, if any, as the stored member CCF_DICT_NAME. It is a
+// zstd dictionary, LZ4 uses its last 64 KiB.
+#define CCF_DICT_NAME ".ccfreeze/dict"
+
+struct ccf_entry {
+	const char *name;	// points into the mapping, not NUL terminated
+	unsigned int name_len;
+	unsigned int method;
+	unsigned int crc;
+	size_t csize;		// compressed size
+	size_t usize;		// uncompressed size
+	size_t header_offset;	// local file header, relative to base
+	size_t data_offset;	// data relative to base, 0 if not looked up yet
+};
+
+struct ccf_archive {
+	char *path;
+	const unsigned char *map;
+	size_t map_size;
+	const unsigned char *base;	// start of the archive inside the mapping
+	size_t size;
+	int pack;		// a pack file, not a zip file
+	size_t arc_offset;	// bytes prepended to the zip data
+	const unsigned char *index;	// module index, 0 if there is none
+	size_t index_size;
+	struct ccf_entry *entries;	// built on first use if there is an index
+	unsigned int count;
+	unsigned int *table;	// open addressing, entry index + 1, 0 == empty
+	unsigned int mask;
+	const unsigned char *dict;	// see CCF_DICT_NAME, 0 if there is none
+	size_t dict_size;
+	void *ddict;		// the digested zstd dictionary
+};
+
+// the archive the loader runs from once it has been opened
+extern struct ccf_archive *ccf_loader_archive;
+
+// map path, which is either a zip file or a file with an appended archive.
+// Exits with a fatal error if the archive is compressed with a method this
+// build does not support (see pack.py compress).
+struct ccf_archive *ccf_archive_open(const char *path);
+// like ccf_archive_open, but fails quickly without mapping anything if
+// path does not end with a trailer
+struct ccf_archive *ccf_payload_open(const char *path);
+void ccf_archive_close(struct ccf_archive *ar);
+
+// the CRC-32 of zip and zlib, safe to call from any thread
+unsigned int ccf_crc32(unsigned int crc, const unsigned char *p, size_t len);
+
+// crc32 of everything from the central directory on, or of a pack file's
+// metadata, as stored in the trailer. It changes with any member.
+unsigned int ccf_archive_checksum(const struct ccf_archive *ar);
+
+const struct ccf_entry *ccf_archive_find(struct ccf_archive *ar,
+					 const char *name, size_t len);
+
+// look up a module by its dotted name in the index. Returns 1 and fills
+// *e and *flags if found, 0 if the module is not in the archive and -1 if
+// the archive has no index.
+int ccf_archive_find_module(const struct ccf_archive *ar, const char *fullname,
+			    size_t len, struct ccf_entry *e, int *flags);
+
+// look up a member below .ccfreeze/ by file name, through the index if
+// there is one. Returns 1 and fills *e if found, 0 otherwise.
+int ccf_archive_find_meta(struct ccf_archive *ar, const char *name, struct ccf_entry *e);
+
+// ask the kernel to read the front of ar, up to CCF_READAHEAD_NAME, in one
+// go. Does nothing if ar, which may be 0, has no such member.
+void ccf_archive_readahead(struct ccf_archive *ar);
+
+// pointer to the (possibly compressed) bytes of an entry inside the mapping
+const unsigned char *ccf_entry_raw(const struct ccf_archive *ar,
+				   const struct ccf_entry *e);
+
+// get the uncompressed bytes of an entry. Stored entries are returned
+// straight out of the mapping and *owned is set to NULL, otherwise the data
+// is inflated into a malloc'ed buffer which the caller must free(*owned).
+// Returns -1 if the entry is corrupt or the compression method is not
+// supported by this build (deflate needs WITH_ZLIB, zstd WITH_ZSTD and
+// LZ4 WITH_LZ4). Safe to call from any thread.
+int ccf_entry_read(const struct ccf_archive *ar, const struct ccf_entry *e,
+		   const unsigned char **data, void **owned);
+
+#endif
@@ -0,0 +1,407 @@
+// batch mode, see batch.h
+
+#include <Python.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdio_ext.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "batch.h"
+#include "report.h"
+
+// a line written at once, see ccf_report_write
+#define RESULT_SIZE PIPE_BUF
+
+static struct {
+	char *name;
+	FILE *in;
+	const char *results;
+	char *argv0;
+	int saved_fds[3];	// the loader's stdio
+	int saved_cwd;
+	int number;
+	char *line;
+	size_t line_size;
+
+	// the current job
+	char *id;
+	char *cwd;
+	char *files[3];
+	char **argv;
+	int argc;
+	int argv_size;
+	char error[512];
+	long long start;
+	long long start_cpu;
+} batch;
+
+int ccf_batch_enabled(void)
+{
+	const char *jobs = getenv(CCF_BATCH_ENV);
+
+	return jobs && *jobs;
+}
+
+static long long cpu_ns(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000LL
+		+ (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000LL;
+}
+
+// keep programs the jobs start from running batches themselves
+static void forget_env(const char *name)
+{
+	PyObject *posix, *env;
+
+	unsetenv(name);
+	posix = PyDict_GetItemString(PyImport_GetModuleDict(), "posix");
+	env = posix ? PyObject_GetAttrString(posix, "environ") : 0;
+	if (env && PyDict_Check(env) && PyDict_GetItemString(env, name)) {
+		PyDict_DelItemString(env, name);
+	}
+	Py_XDECREF(env);
+	PyErr_Clear();
+}
+
+static int open_jobs(void)
+{
+	const char *name = getenv(CCF_BATCH_ENV);
+	PyObject *argv = PySys_GetObject("argv");
+	char *end;
+	long fd;
+	int i, null;
+
+	fd = strtol(name, &end, 10);
+	if (strcmp(name, "-") == 0) {
+		// the jobs' stdin is /dev/null instead
+		fd = dup(0);
+		null = open("/dev/null", O_RDONLY);
+		if (fd >= 0 && null >= 0) {
+			dup2(null, 0);
+		}
+		if (null >= 0) {
+			close(null);
+		}
+	} else if (*end || end == name) {
+		fd = open(name, O_RDONLY);
+	}
+	if (fd < 0 || !(batch.in = fdopen(fd, "r"))) {
+		PyErr_SetFromErrnoWithFilename(PyExc_OSError, (char *)name);
+		return -1;
+	}
+	batch.name = strdup(name);
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	for (i = 0; i < 3; i++) {
+		batch.saved_fds[i] = fcntl(i, F_DUPFD_CLOEXEC, 3);
+	}
+	batch.saved_cwd = open(".", O_RDONLY | O_CLOEXEC);
+	batch.results = getenv(CCF_BATCH_RESULTS_ENV);
+	if (!batch.results || !*batch.results) {
+		batch.results = "2";
+	}
+	if (argv && PyList_Check(argv) && PyList_GET_SIZE(argv)
+	    && PyString_Check(PyList_GET_ITEM(argv, 0))) {
+		batch.argv0 = strdup(PyString_AS_STRING(PyList_GET_ITEM(argv, 0)));
+	}
+	if (!batch.argv0) {
+		batch.argv0 = strdup("");
+	}
+	forget_env(CCF_BATCH_ENV);
+	return 0;
+}
+
+static void clear_job(void)
+{
+	int i;
+
+	free(batch.id);
+	free(batch.cwd);
+	for (i = 0; i < 3; i++) {
+		free(batch.files[i]);
+	}
+	for (i = 0; i < batch.argc; i++) {
+		free(batch.argv[i]);
+	}
+	batch.id = batch.cwd = 0;
+	memset(batch.files, 0, sizeof(batch.files));
+	batch.argc = 0;
+	batch.error[0] = 0;
+}
+
+static void set_error(const char *fmt, ...)
+{
+	va_list ap;
+
+	if (batch.error[0]) {
+		return;
+	}
+	va_start(ap, fmt);
+	vsnprintf(batch.error, sizeof(batch.error), fmt, ap);
+	va_end(ap);
+}
+
+static void add_arg(const char *arg)
+{
+	char **argv;
+	int size;
+
+	if (batch.argc == batch.argv_size) {
+		size = batch.argv_size ? 2 * batch.argv_size : 16;
+		argv = realloc(batch.argv, size * sizeof(*argv));
+		if (!argv) {
+			set_error("out of memory");
+			return;
+		}
+		batch.argv = argv;
+		batch.argv_size = size;
+	}
+	batch.argv[batch.argc] = strdup(arg);
+	if (batch.argv[batch.argc]) {
+		batch.argc++;
+	}
+}
+
+static void set_field(char **field, const char *value)
+{
+	free(*field);
+	*field = strdup(value);
+}
+
+// read the lines of the next job, returns 0 if there are none
+static int read_job(void)
+{
+	ssize_t n;
+	int fields = 0;
+	char *value;
+
+	clear_job();
+	add_arg(batch.argv0);
+	while ((n = getline(&batch.line, &batch.line_size, batch.in)) >= 0) {
+		while (n && (batch.line[n - 1] == '\n' || batch.line[n - 1] == '\r')) {
+			batch.line[--n] = 0;
+		}
+		if (!n) {
+			if (fields) {
+				return 1;
+			}
+			continue;
+		}
+		if (batch.line[0] == '#') {
+			continue;
+		}
+		fields++;
+		value = strchr(batch.line, '=');
+		if (!value) {
+			set_error("bad line: %s", batch.line);
+			continue;
+		}
+		*value++ = 0;
+		if (strcmp(batch.line, "arg") == 0) {
+			add_arg(value);
+		} else if (strcmp(batch.line, "id") == 0) {
+			set_field(&batch.id, value);
+		} else if (strcmp(batch.line, "cwd") == 0) {
+			set_field(&batch.cwd, value);
+		} else if (strcmp(batch.line, "stdin") == 0) {
+			set_field(&batch.files[0], value);
+		} else if (strcmp(batch.line, "stdout") == 0) {
+			set_field(&batch.files[1], value);
+		} else if (strcmp(batch.line, "stderr") == 0) {
+			set_field(&batch.files[2], value);
+		} else {
+			set_error("unknown field: %s", batch.line);
+		}
+	}
+	return fields != 0;
+}
+
+static void flush_stdio(void)
+{
+	static const char *names[] = {"stdout", "stderr", 0};
+	PyObject *f, *res;
+	int i;
+
+	for (i = 0; names[i]; i++) {
+		f = PySys_GetObject((char *)names[i]);
+		if (f && f != Py_None) {
+			res = PyObject_CallMethod(f, "flush", "");
+			Py_XDECREF(res);
+		}
+	}
+	PyErr_Clear();
+	fflush(0);
+}
+
+// drop what was read ahead from the old fd 0 when a job's stdin file
+// comes or goes, by the C stdin and by file.next() behind sys.stdin
+static void purge_stdin(void)
+{
+	PyFileObject *f = (PyFileObject *)PySys_GetObject("stdin");
+
+	if (f && PyFile_Check(f) && f->f_fp == stdin && f->f_buf) {
+		PyMem_Free(f->f_buf);
+		f->f_buf = 0;
+	}
+	__fpurge(stdin);
+}
+
+// the modules of CCF_BATCH_FRESH_ENV and their submodules
+static void forget_modules(void)
+{
+	const char *fresh = getenv(CCF_BATCH_FRESH_ENV), *name, *end;
+	PyObject *modules = PyImport_GetModuleDict(), *keys;
+	Py_ssize_t i;
+	size_t len;
+	char *key;
+
+	if (!fresh || !*fresh || !(keys = PyDict_Keys(modules))) {
+		PyErr_Clear();
+		return;
+	}
+	for (i = 0; i < PyList_GET_SIZE(keys); i++) {
+		if (!PyString_Check(PyList_GET_ITEM(keys, i))) {
+			continue;
+		}
+		key = PyString_AS_STRING(PyList_GET_ITEM(keys, i));
+		for (name = fresh; *name; name = *end ? end + 1 : end) {
+			end = strchr(name, ',');
+			if (!end) {
+				end = name + strlen(name);
+			}
+			len = end - name;
+			if (len && strncmp(key, name, len) == 0 && (!key[len] || key[len] == '.')) {
+				PyDict_DelItem(modules, PyList_GET_ITEM(keys, i));
+				break;
+			}
+		}
+	}
+	Py_DECREF(keys);
+	PyErr_Clear();
+}
+
+static int start_job(void)
+{
+	int i, fd;
+
+	if (batch.error[0]) {
+		return -1;
+	}
+	if (batch.cwd && chdir(batch.cwd) != 0) {
+		set_error("%s: %s", batch.cwd, strerror(errno));
+		return -1;
+	}
+	flush_stdio();
+	for (i = 0; i < 3; i++) {
+		if (!batch.files[i]) {
+			continue;
+		}
+		fd = open(batch.files[i], i ? O_WRONLY | O_CREAT | O_TRUNC : O_RDONLY, 0666);
+		if (fd < 0) {
+			set_error("%s: %s", batch.files[i], strerror(errno));
+			return -1;
+		}
+		dup2(fd, i);
+		close(fd);
+	}
+	if (batch.files[0]) {
+		purge_stdin();
+	}
+	clearerr(stdin);
+	forget_modules();
+	PySys_SetArgvEx(batch.argc, batch.argv, 0);
+	return 0;
+}
+
+static void append_string(char *buf, size_t size, const char *s)
+{
+	size_t len = strlen(buf);
+
+	for (; *s && len + 8 < size; s++) {
+		unsigned char c = *s;
+
+		if (c == '"' || c == '\\') {
+			len += sprintf(buf + len, "\\%c", c);
+		} else if (c < 0x20) {
+			len += sprintf(buf + len, "\\u%04x", c);
+		} else {
+			buf[len++] = c;
+		}
+	}
+	buf[len] = 0;
+}
+
+static void write_result(int status)
+{
+	char buf[RESULT_SIZE];
+	size_t len;
+
+	snprintf(buf, sizeof(buf), "{\"job\": %d, \"id\": ", batch.number);
+	if (batch.id) {
+		strcat(buf, "\"");
+		append_string(buf, sizeof(buf) - 128, batch.id);
+		strcat(buf, "\"");
+	} else {
+		strcat(buf, "null");
+	}
+	len = strlen(buf);
+	snprintf(buf + len, sizeof(buf) - len, ", \"status\": %d, \"wall_ns\": %lld, \"cpu_ns\": %lld",
+		 status, ccf_now() - batch.start, cpu_ns() - batch.start_cpu);
+	if (batch.error[0]) {
+		strcat(buf, ", \"error\": \"");
+		append_string(buf, sizeof(buf) - 8, batch.error);
+		strcat(buf, "\"");
+	}
+	strcat(buf, "}\n");
+	ccf_report_write(batch.results, buf, strlen(buf));
+}
+
+void ccf_batch_end(int status)
+{
+	int i;
+
+	flush_stdio();
+	for (i = 0; i < 3; i++) {
+		if (batch.saved_fds[i] >= 0) {
+			dup2(batch.saved_fds[i], i);
+		}
+	}
+	if (batch.files[0]) {
+		purge_stdin();
+	}
+	clearerr(stdin);
+	if (batch.saved_cwd >= 0 && fchdir(batch.saved_cwd) != 0) {
+		set_error("can't return to the working directory: %s", strerror(errno));
+	}
+	write_result(status);
+	batch.number++;
+}
+
+int ccf_batch_begin(void)
+{
+	if (!batch.in && open_jobs() != 0) {
+		return -1;
+	}
+	while (read_job()) {
+		batch.start = ccf_now();
+		batch.start_cpu = cpu_ns();
+		if (start_job() == 0) {
+			return 1;
+		}
+		ccf_batch_end(127);
+	}
+	if (ferror(batch.in)) {
+		PyErr_SetFromErrnoWithFilename(PyExc_OSError, batch.name);
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,50 @@
+// batch mode
+//
+// A loader started with CCFREEZE_BATCH set to a file name, to the number of
+// an open file descriptor or to "-" for stdin initializes Python once and
+// then runs __main__ for every job it reads from there, each in a fresh
+// namespace. Modules imported by one job stay imported for the next ones,
+// except those in CCFREEZE_BATCH_FRESH, a comma separated list of modules
+// which are removed from sys.modules with their submodules before each job.
+//
+// Jobs are blocks of name=value lines ended by an empty line:
+//
+//	id	echoed in the job's result
+//	arg	one per argument, sys.argv[0] stays the loader's
+//	cwd	working directory of the job, relative to the loader's
+//	stdin, stdout, stderr
+//		files for the job's stdio, relative to cwd. Output files are
+//		truncated. By default the job gets the loader's stdio, except
+//		that stdin is /dev/null when the jobs come from stdin.
+//
+// For each job a line of JSON is appended to CCFREEZE_BATCH_RESULTS, a file
+// name or file descriptor number (default: 2): the job's number from 0, its
+// id, its exit status (127 if it could not be started, then with an error
+// message), and its wall and CPU time in nanoseconds. The loader exits
+// with 1 if any job failed.
+//
+// Jobs share the process: threads they leave running, atexit handlers,
+// signal handlers and changes to os.environ outlive them, and os._exit()
+// ends the batch.
+
+#ifndef CCFREEZE_BATCH_H
+#define CCFREEZE_BATCH_H
+
+#define CCF_BATCH_ENV "CCFREEZE_BATCH"
+#define CCF_BATCH_RESULTS_ENV "CCFREEZE_BATCH_RESULTS"
+#define CCF_BATCH_FRESH_ENV "CCFREEZE_BATCH_FRESH"
+
+// 1 if CCF_BATCH_ENV is set
+int ccf_batch_enabled(void);
+
+// read the next job and switch to its arguments, working directory and
+// stdio. Returns 1 when it's ready to run, 0 after the last job and -1
+// with a Python exception set if the jobs can't be read. Jobs that can't
+// be started are reported and skipped.
+int ccf_batch_begin(void);
+
+// report the status of the job and switch back to the loader's working
+// directory and stdio
+void ccf_batch_end(int status);
+
+#endif
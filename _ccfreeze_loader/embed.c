@@ -0,0 +1,274 @@
+// running a frozen program inside another process, see embed.h
+
+#include <Python.h>
+
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "archive.h"
+#include "embed.h"
+#include "getpath.h"
+#include "importer.h"
+#include "options.h"
+#include "prefetch.h"
+#include "shmcache.h"
+#include "trace.h"
+
+#ifdef CCF_FROZEN_MODULES
+// generated by setup.py build_ext --frozen-modules
+extern struct _frozen ccf_frozen_modules[];
+#endif
+
+#ifdef CCF_STATIC_EXTENSIONS
+// generated by setup.py build_ext --static-extensions
+extern struct _inittab ccf_static_extensions[];
+#endif
+
+struct ccf_embed_entry {
+	PyObject *callable;
+};
+
+static int opened = 0;
+// of the thread that opened, while the GIL is released
+static PyThreadState *main_state = 0;
+static __thread char error[1024];
+
+static void set_error(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(error, sizeof(error), fmt, ap);
+	va_end(ap);
+}
+
+// the pending Python exception as "Type: message"
+static void set_python_error(void)
+{
+	PyObject *type, *value, *tb, *name = 0, *text = 0;
+
+	PyErr_Fetch(&type, &value, &tb);
+	PyErr_NormalizeException(&type, &value, &tb);
+	if (type) {
+		name = PyObject_GetAttrString(type, "__name__");
+	}
+	if (value) {
+		text = PyObject_Str(value);
+	}
+	PyErr_Clear();
+	set_error("%s: %s", name && PyString_Check(name) ? PyString_AS_STRING(name) : "?",
+		  text && PyString_Check(text) ? PyString_AS_STRING(text) : "");
+	Py_XDECREF(name);
+	Py_XDECREF(text);
+	Py_XDECREF(type);
+	Py_XDECREF(value);
+	Py_XDECREF(tb);
+}
+
+static int bootstrap(void)
+{
+	PyObject *locals, *res;
+
+	locals = PyDict_New();
+	if (!locals) {
+		return -1;
+	}
+	PyDict_SetItemString(locals, "__builtins__", PyEval_GetBuiltins());
+	res = PyRun_String(
+		"import sys\n"
+		"del sys.path[2:]\n"
+		"sys.frozen=1\n"
+		"import _ccfreeze\n"
+		"importer = _ccfreeze.install(sys.path[0])\n",
+		Py_file_input, locals, 0);
+	Py_DECREF(locals);
+	if (!res) {
+		return -1;
+	}
+	Py_DECREF(res);
+	return 0;
+}
+
+int ccf_embed_open(const char *path, int argc, char **argv)
+{
+	static char progpath[PATH_MAX+1];
+	char *default_argv[1];
+
+	if (opened) {
+		set_error("the frozen program is already open");
+		return -1;
+	}
+	if (!realpath(path, progpath)) {
+		set_error("can't find %s", path);
+		return -1;
+	}
+	ccf_trace_init();
+
+	Py_NoSiteFlag = 1;
+	Py_FrozenFlag = 1;
+	Py_IgnoreEnvironmentFlag = 1;
+	Py_DontWriteBytecodeFlag = 1;
+	Py_NoUserSiteDirectory = 1;
+	Py_SetPythonHome("");
+	Py_SetProgramName(progpath);
+	ccf_program_path_resolved = 1;
+
+	// maps the archive, which holds the options
+	ccf_get_syspath();
+	if (!ccf_loader_archive) {
+		set_error("no archive for %s", progpath);
+		return -1;
+	}
+	ccf_archive_readahead(ccf_loader_archive);
+	ccf_options_load(ccf_loader_archive);
+	ccf_shm_cache_open(ccf_loader_archive);
+	ccf_prefetch_start(ccf_loader_archive);
+	PyImport_AppendInittab("_ccfreeze", init_ccfreeze);
+#ifdef CCF_STATIC_EXTENSIONS
+	PyImport_ExtendInittab(ccf_static_extensions);
+#endif
+#ifdef CCF_FROZEN_MODULES
+	PyImport_FrozenModules = ccf_frozen_modules;
+#endif
+
+	// signal handlers are the host's business
+	Py_InitializeEx(0);
+	PyEval_InitThreads();
+	if (!argv || argc < 1) {
+		default_argv[0] = progpath;
+		argv = default_argv;
+		argc = 1;
+	}
+	PySys_SetArgvEx(argc, argv, 0);
+	PySys_SetPath(ccf_get_syspath());
+	if (bootstrap() != 0) {
+		set_python_error();
+		ccf_embed_close();
+		return -1;
+	}
+	// what the host imports later is read on demand, like a program's
+	// imports after __main__ returns
+	ccf_prefetch_stop();
+	opened = 1;
+	main_state = PyEval_SaveThread();
+	return 0;
+}
+
+struct ccf_embed_entry *ccf_embed_lookup(const char *name)
+{
+	struct ccf_embed_entry *entry = 0;
+	PyGILState_STATE gil;
+	PyObject *obj, *attr;
+	const char *colon = strchr(name, ':');
+	char *module, *p, *next;
+
+	if (!main_state) {
+		set_error("the frozen program is not open");
+		return 0;
+	}
+	if (!colon || !colon[1]) {
+		set_error("%s is not module:name", name);
+		return 0;
+	}
+	module = strdup(name);
+	if (!module) {
+		set_error("out of memory");
+		return 0;
+	}
+	module[colon - name] = 0;
+
+	gil = PyGILState_Ensure();
+	obj = PyImport_ImportModule(module);
+	for (p = module + (colon - name) + 1; obj && p; p = next) {
+		next = strchr(p, '.');
+		if (next) {
+			*next++ = 0;
+		}
+		attr = PyObject_GetAttrString(obj, p);
+		Py_DECREF(obj);
+		obj = attr;
+	}
+	if (obj && !PyCallable_Check(obj)) {
+		PyErr_Format(PyExc_TypeError, "%s is not callable", name);
+		Py_CLEAR(obj);
+	}
+	if (obj) {
+		entry = malloc(sizeof(*entry));
+		if (entry) {
+			entry->callable = obj;
+		} else {
+			Py_DECREF(obj);
+			PyErr_NoMemory();
+		}
+	}
+	if (!entry) {
+		set_python_error();
+	}
+	PyGILState_Release(gil);
+	free(module);
+	return entry;
+}
+
+int ccf_embed_call(struct ccf_embed_entry *entry, const void *arg, size_t len,
+		   void **result, size_t *result_len)
+{
+	PyGILState_STATE gil;
+	PyObject *res;
+	const void *data;
+	Py_ssize_t size;
+	int status = -1;
+
+	*result = 0;
+	*result_len = 0;
+	gil = PyGILState_Ensure();
+	res = PyObject_CallFunction(entry->callable, "s#", (const char *)arg, (Py_ssize_t)len);
+	if (!res) {
+		set_python_error();
+	} else if (res == Py_None) {
+		status = 0;
+	} else if (PyObject_AsReadBuffer(res, &data, &size) != 0) {
+		set_python_error();
+	} else if (!(*result = malloc(size ? size : 1))) {
+		set_error("out of memory");
+	} else {
+		memcpy(*result, data, size);
+		*result_len = size;
+		status = 0;
+	}
+	Py_XDECREF(res);
+	PyGILState_Release(gil);
+	return status;
+}
+
+void ccf_embed_release(struct ccf_embed_entry *entry)
+{
+	PyGILState_STATE gil;
+
+	if (!entry) {
+		return;
+	}
+	gil = PyGILState_Ensure();
+	Py_DECREF(entry->callable);
+	PyGILState_Release(gil);
+	free(entry);
+}
+
+const char *ccf_embed_error(void)
+{
+	return error;
+}
+
+void ccf_embed_close(void)
+{
+	if (main_state) {
+		PyEval_RestoreThread(main_state);
+		main_state = 0;
+	}
+	if (Py_IsInitialized()) {
+		Py_Finalize();
+	}
+	ccf_prefetch_stop();
+}
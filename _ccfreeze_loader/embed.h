@@ -0,0 +1,58 @@
+// running a frozen program inside another process
+//
+// setup.py build_ext builds libccfreeze_loader.a next to the loaders: the
+// loader without its main(), for programs that call into a frozen payload
+// many times instead of starting it once per request. Link it before
+// libpython and its libraries, e.g.
+//
+//	cc host.o libccfreeze_loader.a -lpython2.7 -lz -ldl -lm -lpthread
+//
+// Python is initialized once per process by ccf_embed_open() and the
+// program's modules are imported from its archive as in the loader.
+// Between calls the GIL is released: any thread may call an entry point,
+// the calls themselves run one at a time. The loader's stdio, allocator,
+// zygote and exit options don't apply, the host owns its process.
+
+#ifndef CCFREEZE_EMBED_H
+#define CCFREEZE_EMBED_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// a callable of the frozen program
+struct ccf_embed_entry;
+
+// initialize Python for the frozen program at path, a single-file
+// executable or any file next to its library.zip, as the loader would for
+// an executable at path. argv, which may be 0, becomes sys.argv. Returns 0,
+// or -1 if there is no archive or Python failed to start. Can only be done
+// once per process.
+int ccf_embed_open(const char *path, int argc, char **argv);
+
+// look up "module:name", where name may be dotted, importing module if
+// necessary. Returns 0 on errors.
+struct ccf_embed_entry *ccf_embed_lookup(const char *name);
+
+// call entry with the len bytes at arg as a str. A str or buffer result is
+// copied into *result, which the caller frees with free(), None gives a 0
+// *result. Returns 0, or -1 if the call raised or returned something else.
+int ccf_embed_call(struct ccf_embed_entry *entry, const void *arg, size_t len,
+		   void **result, size_t *result_len);
+
+void ccf_embed_release(struct ccf_embed_entry *entry);
+
+// what the last failing ccf_embed_* call of this thread failed with
+const char *ccf_embed_error(void);
+
+// finalize Python, from the thread that opened it, once no other thread
+// is in a call. Entries must have been released.
+void ccf_embed_close(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,167 @@
+// C extensions loaded from the archive, see extension.h
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include "extension.h"
+#include "record.h"
+
+// a static executable has no libpython for extensions to link against
+#if defined(SYS_memfd_create) && !defined(CCF_STATIC_LINK)
+#define HAVE_MEMFD 1
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x1U
+#define MFD_ALLOW_SEALING 0x2U
+#endif
+#endif
+
+int ccf_extension_supported(void)
+{
+#ifdef HAVE_MEMFD
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+#ifdef HAVE_MEMFD
+// memfds by member. They are never closed: dlopen() goes by the path, and
+// a new library at a reused /proc/self/fd/N would be taken for the old one.
+static struct cached {
+	char *name;
+	size_t name_len;
+	unsigned int crc;
+	size_t size;
+	int fd;
+} *cache = 0;
+static int cached = 0, allocated = 0;
+
+static int add_cached(const struct ccf_entry *e, int fd)
+{
+	struct cached *c;
+	int n;
+
+	if (cached == allocated) {
+		n = allocated ? 2 * allocated : 16;
+		c = realloc(cache, n * sizeof(*c));
+		if (!c) {
+			return -1;
+		}
+		cache = c;
+		allocated = n;
+	}
+	c = &cache[cached];
+	c->name = malloc(e->name_len);
+	if (!c->name) {
+		return -1;
+	}
+	memcpy(c->name, e->name, e->name_len);
+	c->name_len = e->name_len;
+	c->crc = e->crc;
+	c->size = e->usize;
+	c->fd = fd;
+	cached++;
+	return 0;
+}
+
+static int write_all(int fd, const unsigned char *p, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int create(const struct ccf_archive *ar, const struct ccf_entry *e)
+{
+	const unsigned char *data;
+	char name[64];
+	const char *base;
+	size_t len;
+	void *owned;
+	int fd, err;
+
+	ccf_record_entry(e);
+	if (ccf_entry_read(ar, e, &data, &owned) != 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	// the name shows up in /proc/PID/maps
+	base = e->name + e->name_len;
+	while (base > e->name && base[-1] != '/') {
+		base--;
+	}
+	len = e->name + e->name_len - base;
+	if (len >= sizeof(name)) {
+		len = sizeof(name) - 1;
+	}
+	memcpy(name, base, len);
+	name[len] = 0;
+
+	fd = syscall(SYS_memfd_create, name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0 && errno == EINVAL) {
+		fd = syscall(SYS_memfd_create, name, MFD_CLOEXEC);
+	}
+	if (fd < 0) {
+		free(owned);
+		return -1;
+	}
+	err = write_all(fd, data, e->usize);
+	free(owned);
+	if (err != 0) {
+		err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+#ifdef F_ADD_SEALS
+	// shared between processes, make sure nobody changes it
+	fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+#endif
+	return fd;
+}
+#endif
+
+int ccf_extension_fd(const struct ccf_archive *ar, const struct ccf_entry *e)
+{
+#ifdef HAVE_MEMFD
+	const struct cached *c;
+	int i, fd;
+
+	for (i = 0; i < cached; i++) {
+		c = &cache[i];
+		if (c->crc == e->crc && c->size == e->usize && c->name_len == e->name_len
+		    && memcmp(c->name, e->name, e->name_len) == 0) {
+			return c->fd;
+		}
+	}
+	fd = create(ar, e);
+	if (fd >= 0 && add_cached(e, fd) != 0) {
+		close(fd);
+		errno = ENOMEM;
+		return -1;
+	}
+	return fd;
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
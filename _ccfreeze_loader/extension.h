@@ -0,0 +1,25 @@
+// C extensions loaded from the archive
+//
+// An extension module stored in the archive is copied into an anonymous
+// memfd, which the importer dlopen()s as /proc/self/fd/N. Nothing is
+// written to the file system. The memfds stay open and are reused when
+// the same member is loaded again, also by the children of a zygote.
+//
+// Only available on Linux, elsewhere extensions have to be shipped next to
+// the executable as before. A loader built with setup.py build_ext --static
+// cannot load extensions at all, they have to be linked in with
+// --static-extensions.
+
+#ifndef CCFREEZE_EXTENSION_H
+#define CCFREEZE_EXTENSION_H
+
+#include "archive.h"
+
+// 1 if this build can load extensions from the archive
+int ccf_extension_supported(void);
+
+// a read-only file descriptor with the contents of e, -1 with errno set on
+// errors. It stays open, the caller must not close it.
+int ccf_extension_fd(const struct ccf_archive *ar, const struct ccf_entry *e);
+
+#endif
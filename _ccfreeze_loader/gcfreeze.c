@@ -0,0 +1,100 @@
+// copy-on-write friendly garbage collection, see gcfreeze.h
+
+#include <Python.h>
+
+#include <limits.h>
+#include <string.h>
+
+#include "gcfreeze.h"
+#include "options.h"
+
+// collections are this rare while paused, which bounds what cycles can
+// pile up if startup never ends
+#define PAUSE_THRESHOLD 100000
+
+static int paused = 0;
+static int frozen = 0;
+static int saved[3];
+
+static int enabled(void)
+{
+	const char *mode = ccf_option("gc");
+
+	return mode && strcmp(mode, "freeze") == 0;
+}
+
+// gc.<method>(), errors are ignored
+static void call(const char *method)
+{
+	PyObject *gc, *res = 0;
+
+	gc = PyImport_ImportModule("gc");
+	if (gc) {
+		res = PyObject_CallMethod(gc, (char *)method, 0);
+		Py_DECREF(gc);
+	}
+	Py_XDECREF(res);
+	PyErr_Clear();
+}
+
+// gc.get_threshold() into t, -1 on errors
+static int get_threshold(int t[3])
+{
+	PyObject *gc, *res = 0;
+	int ok = 0;
+
+	gc = PyImport_ImportModule("gc");
+	if (gc) {
+		res = PyObject_CallMethod(gc, "get_threshold", 0);
+		Py_DECREF(gc);
+	}
+	ok = res && PyArg_ParseTuple(res, "iii", &t[0], &t[1], &t[2]);
+	Py_XDECREF(res);
+	PyErr_Clear();
+	return ok ? 0 : -1;
+}
+
+static void set_threshold(int t0, int t1, int t2)
+{
+	PyObject *gc, *res = 0;
+
+	gc = PyImport_ImportModule("gc");
+	if (gc) {
+		res = PyObject_CallMethod(gc, "set_threshold", "iii", t0, t1, t2);
+		Py_DECREF(gc);
+	}
+	Py_XDECREF(res);
+	PyErr_Clear();
+}
+
+void ccf_gc_pause(void)
+{
+	if (!paused && !frozen && enabled() && get_threshold(saved) == 0) {
+		set_threshold(PAUSE_THRESHOLD, saved[1], saved[2]);
+		paused = 1;
+	}
+}
+
+void ccf_gc_resume(void)
+{
+	if (paused) {
+		set_threshold(saved[0], saved[1], saved[2]);
+		paused = 0;
+	}
+}
+
+void ccf_gc_freeze(void)
+{
+	int t[3];
+
+	if (frozen || !enabled()) {
+		return;
+	}
+	frozen = 1;
+	ccf_gc_resume();
+	// the survivors end up in the oldest generation
+	call("collect");
+	if (get_threshold(t) == 0) {
+		set_threshold(t[0], t[1], INT_MAX);
+	}
+}
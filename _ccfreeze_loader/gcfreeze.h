@@ -0,0 +1,29 @@
+// copy-on-write friendly garbage collection for pre-forking programs
+//
+// With the freeze-time option gc=freeze, the cyclic garbage collector
+// runs only every 100000 allocations from the start of the bootstrap,
+// through the imports of __main__ or of a zygote's preload, until startup
+// is done (see ccf_startup_done()). Then one full collection moves
+// everything that is alive into the oldest generation, which is then never
+// collected again: forked children no longer write to the pages of those
+// objects when the collector runs. Reference cycles that survive two
+// younger collections from then on are only freed by an explicit
+// gc.collect().
+//
+// Startup is done when the program calls _ccfreeze.startup_done(), at its
+// first os.fork() or os.forkpty(), when a zygote starts serving, or when
+// the top level of __main__ returns, whichever comes first.
+//
+// Python 2 has no gc.freeze(), this is the closest it gets.
+
+#ifndef CCFREEZE_GCFREEZE_H
+#define CCFREEZE_GCFREEZE_H
+
+// make collections rare, if gc=freeze
+void ccf_gc_pause(void);
+// back to the usual thresholds after ccf_gc_pause
+void ccf_gc_resume(void);
+// collect and stop collecting the oldest generation, if gc=freeze
+void ccf_gc_freeze(void);
+
+#endif
@@ -10,6 +10,10 @@
 #include <mach-o/dyld.h>
 #endif
 
+#include "archive.h"
+#include "getpath.h"
+#include "report.h"
+
 /* Search in some common locations for the associated Python libraries.
  *
  * Two directories must be found, the platform independent directory
@@ -131,9 +135,12 @@ static char progpath[MAXPATHLEN+1];
 static char *module_search_path = NULL;
 static char lib_python[] = "lib/python" VERSION;
 static char *syspath=0;
+static char *initpath=0;
 
 static void compute_syspath(void);
 
+int ccf_program_path_resolved = 0;
+
 static void
 reduce(char *dir)
 {
@@ -366,6 +373,29 @@ search_for_exec_prefix(char *argv0_path, char *home)
 }
 
 
+/* Frozen programs only need the directory of the executable: sys.path is
+ * computed by compute_syspath() and there is no installation to find. With
+ * the canonical executable path already known, this takes no system calls
+ * besides looking for an appended archive.
+ */
+static void
+calculate_frozen_path(void)
+{
+    static char separator[2] = {SEP, '\0'};
+
+    strncpy(progpath, Py_GetProgramName(), MAXPATHLEN);
+    progpath[MAXPATHLEN] = '\0';
+
+    strcpy(prefix, progpath);
+    reduce(prefix);
+    if (!prefix[0])
+        strcpy(prefix, separator);
+    strcpy(exec_prefix, prefix);
+
+    compute_syspath();
+    module_search_path = syspath;
+}
+
 static void
 calculate_path(void)
 {
@@ -396,6 +426,11 @@ calculate_path(void)
 #endif
 #endif
 
+	if (Py_FrozenFlag && ccf_program_path_resolved) {
+		calculate_frozen_path();
+		return;
+	}
+
 	/* If there is no slash in the argv0 path, then we have to
 	 * assume python is on the user's $PATH, since there's no
 	 * other way to find a directory to start the search from.  If
@@ -658,6 +693,11 @@ calculate_path(void)
 
 /* External interface */
 
+/* Py_Initialize only gets the directory of the executable: it looks up
+ * the locale's codec while zipimport is the only path hook, which would read
+ * the whole archive directory. The loader sets the full path returned by
+ * ccf_get_syspath() once its own importer is installed.
+ */
 char *
 Py_GetPath(void)
 {
@@ -665,7 +705,15 @@ Py_GetPath(void)
         calculate_path();
     /* return module_search_path; */
 
-    compute_syspath();
+    if (!syspath)
+        compute_syspath();
+    return initpath;
+}
+
+char *
+ccf_get_syspath(void)
+{
+    Py_GetPath();
     return syspath;
 }
 
@@ -695,21 +743,37 @@ Py_GetProgramFullPath(void)
 
 static void compute_syspath(void)
 {
-	char *resolved_path = strdup(Py_GetProgramFullPath());
+	char *resolved_path;
+
+	ccf_phase_begin(CCF_PHASE_SYSPATH);
+	resolved_path = strdup(progpath);
 
 #ifdef HAVE_REALPATH
 	static char buffer[PATH_MAX+1];
 
-	if (realpath(resolved_path, buffer)) {
+	if (!ccf_program_path_resolved && realpath(resolved_path, buffer)) {
 		resolved_path = buffer;
 	}
 #endif
 
-	reduce(resolved_path);
 	syspath = malloc(2*strlen(resolved_path)+64);
 
-	sprintf(syspath, "%s%clibrary.zip%c%s", resolved_path, SEP, DELIM, resolved_path);
+	/* single-file executable: import from the archive appended to ourselves */
+	ccf_loader_archive = ccf_payload_open(resolved_path);
+	if (ccf_loader_archive) {
+		sprintf(syspath, "%s%c", resolved_path, DELIM);
+		reduce(resolved_path);
+		strcat(syspath, resolved_path);
+	} else {
+		reduce(resolved_path);
+		sprintf(syspath, "%s%clibrary.zip", resolved_path, SEP);
+		/* mapped here already, the loader reads its options before Py_Initialize */
+		ccf_loader_archive = ccf_archive_open(syspath);
+		sprintf(syspath + strlen(syspath), "%c%s", DELIM, resolved_path);
+	}
+	initpath = strdup(resolved_path);
 	//fprintf(stderr, "syspath: %s\n", syspath);
+	ccf_phase_end(CCF_PHASE_SYSPATH);
 }
 
 #ifdef __cplusplus
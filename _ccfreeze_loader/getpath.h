@@ -0,0 +1,15 @@
+// the loader's additions to getpath.c
+
+#ifndef CCFREEZE_GETPATH_H
+#define CCFREEZE_GETPATH_H
+
+// set by the loader when the program name is the canonical path of the
+// executable, e.g. read from /proc/self/exe. calculate_path() then skips
+// the prefix search and compute_syspath() the realpath() call.
+extern int ccf_program_path_resolved;
+
+// the sys.path of the frozen program, Py_GetPath() only returns the
+// directory of the executable
+char *ccf_get_syspath(void);
+
+#endif
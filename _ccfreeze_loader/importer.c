@@ -0,0 +1,1271 @@
+// native importer for the library archive
+//
+// _ccfreeze.archiveimporter is a drop-in replacement for
+// zipimport.zipimporter which imports straight out of the mmap'ed archive:
+// the table of contents is built from the mapped central directory and
+// stored .pyc files are unmarshalled in place, without copying.
+// _ccfreeze.resource() gives data files the same treatment.
+
+#include <Python.h>
+#include <osdefs.h>
+#include <marshal.h>
+#include <structmember.h>
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#ifdef HAVE_LANGINFO_H
+#include <locale.h>
+#include <langinfo.h>
+#endif
+
+#include "alloc.h"
+#include "archive.h"
+#include "extension.h"
+#include "gcfreeze.h"
+#include "importer.h"
+#include "prefetch.h"
+#include "record.h"
+#include "report.h"
+#include "shmcache.h"
+#include "trace.h"
+
+// same values as the module index flags
+#define IS_SOURCE 0x0
+#define IS_BYTECODE CCF_INDEX_BYTECODE
+#define IS_PACKAGE CCF_INDEX_PACKAGE
+#define IS_EXTENSION CCF_INDEX_EXTENSION
+
+struct search_order {
+	char suffix[14];
+	int type;
+};
+
+// same order zipimport uses, which does not know about extensions
+static struct search_order searchorder[] = {
+	{"/__init__.pyc", IS_PACKAGE | IS_BYTECODE},
+	{"/__init__.pyo", IS_PACKAGE | IS_BYTECODE},
+	{"/__init__.py", IS_PACKAGE | IS_SOURCE},
+	{".pyc", IS_BYTECODE},
+	{".pyo", IS_BYTECODE},
+	{".py", IS_SOURCE},
+	{".so", IS_EXTENSION},
+	{"", 0}
+};
+
+typedef struct {
+	PyObject_HEAD
+	PyObject *archive;	// path of the archive
+	PyObject *prefix;	// package directory inside the archive, "" or "pkg/"
+} ArchiveImporter;
+
+static PyTypeObject ArchiveImporter_Type;
+
+// the archive the loader runs from, mapped for the lifetime of the process
+static struct ccf_archive *the_archive = 0;
+
+// trace frame of the module load_module is getting the code for
+static struct ccf_trace_frame *loading = 0;
+
+struct entry_data {
+	const char *data;
+	size_t size;
+	void *buf;		// buffer inflated by ccf_entry_read
+	PyObject *obj;		// result of the zlib module fallback
+};
+
+static void entry_data_release(struct entry_data *d)
+{
+	free(d->buf);
+	Py_XDECREF(d->obj);
+	d->buf = 0;
+	d->obj = 0;
+}
+
+// raise exc with fmt, whose first %s is the name of e and second one arg.
+// The name is not NUL terminated and Python 2's PyErr_Format has no %.*s.
+static void set_entry_error(PyObject *exc, const char *fmt, const struct ccf_entry *e,
+			    const char *arg)
+{
+	PyObject *name = PyString_FromStringAndSize(e->name, e->name_len);
+
+	if (name) {
+		PyErr_Format(exc, fmt, PyString_AS_STRING(name), arg);
+		Py_DECREF(name);
+	}
+}
+
+// trade the inflated data of e for the copy in the shared cache, if there
+// is one
+static void share(const struct ccf_entry *e, struct entry_data *d)
+{
+	const char *shared = ccf_shm_cache_put(e, d->data);
+
+	if (shared) {
+		free(d->buf);
+		d->buf = 0;
+		d->data = shared;
+	}
+}
+
+static int entry_data_get(const struct ccf_entry *e, struct entry_data *d)
+{
+	const unsigned char *data;
+	PyObject *zlib, *raw;
+
+	memset(d, 0, sizeof(*d));
+	// once per read by the program, wherever the data comes from
+	ccf_record_entry(e);
+	d->buf = ccf_prefetch_take(e);
+	if (d->buf) {
+		d->data = d->buf;
+		d->size = e->usize;
+		share(e, d);
+		return 0;
+	}
+	d->data = ccf_shm_cache_get(e);
+	if (d->data) {
+		d->size = e->usize;
+		return 0;
+	}
+	if (ccf_entry_read(the_archive, e, &data, &d->buf) == 0) {
+		d->data = (const char *)data;
+		d->size = e->usize;
+		if (d->buf) {
+			share(e, d);
+		}
+		return 0;
+	}
+
+	// loader built without zlib: let the zlib module inflate, which is what
+	// zipimport does
+	if (e->method != CCF_DEFLATED || !ccf_entry_raw(the_archive, e)) {
+		set_entry_error(PyExc_ImportError, "can't read %s from %s", e, the_archive->path);
+		return -1;
+	}
+	zlib = PyImport_ImportModuleNoBlock("zlib");
+	if (!zlib) {
+		PyErr_Clear();
+		PyErr_SetString(PyExc_ImportError, "can't decompress data; zlib not available");
+		return -1;
+	}
+	raw = PyString_FromStringAndSize((const char *)ccf_entry_raw(the_archive, e), e->csize);
+	if (raw) {
+		d->obj = PyObject_CallMethod(zlib, "decompress", "Oi", raw, -15);
+		Py_DECREF(raw);
+	}
+	Py_DECREF(zlib);
+	if (!d->obj) {
+		return -1;
+	}
+	d->data = PyString_AsString(d->obj);
+	d->size = PyString_Size(d->obj);
+	return d->data ? 0 : -1;
+}
+
+static int is_archive_path(const char *path, size_t *prefix_len)
+{
+	size_t n;
+
+	if (!the_archive) {
+		return 0;
+	}
+	n = strlen(the_archive->path);
+	if (strncmp(path, the_archive->path, n) != 0) {
+		return 0;
+	}
+	if (path[n] == 0) {
+		*prefix_len = 0;
+		return 1;
+	}
+	if (path[n] == SEP) {
+		*prefix_len = strlen(path + n + 1);
+		return 1;
+	}
+	return 0;
+}
+
+static const char *get_subname(const char *fullname)
+{
+	const char *dot = strrchr(fullname, '.');
+	return dot ? dot + 1 : fullname;
+}
+
+static int usable(int type)
+{
+	return !(type & IS_EXTENSION) || ccf_extension_supported();
+}
+
+// the module index maps dotted names, only trust it if the entry lives
+// where this importer would look for it
+static int find_indexed(ArchiveImporter *self, const char *fullname,
+			struct ccf_entry *e, int *type)
+{
+	const char *subname = get_subname(fullname), *prefix = PyString_AS_STRING(self->prefix);
+	size_t plen = PyString_GET_SIZE(self->prefix), slen = strlen(subname);
+	int found;
+
+	found = ccf_archive_find_module(the_archive, fullname, strlen(fullname), e, type);
+	if (found == 1 && (!usable(*type) || e->name_len <= plen + slen
+			   || memcmp(e->name, prefix, plen) != 0
+			   || memcmp(e->name + plen, subname, slen) != 0
+			   || (e->name[plen + slen] != '.' && e->name[plen + slen] != '/'))) {
+		return -1;
+	}
+	return found;
+}
+
+// prefix + subname of fullname, fails if that doesn't leave room for a suffix
+static int module_path(ArchiveImporter *self, const char *fullname, char *path)
+{
+	const char *subname = get_subname(fullname);
+	size_t plen = PyString_GET_SIZE(self->prefix);
+
+	if (plen + strlen(subname) + sizeof(searchorder[0].suffix) > MAXPATHLEN) {
+		return 0;
+	}
+	memcpy(path, PyString_AS_STRING(self->prefix), plen);
+	strcpy(path + plen, subname);
+	return 1;
+}
+
+// find the archive entry for fullname, stores its type in *type and the
+// entry name without suffix in path
+static int find_module(ArchiveImporter *self, const char *fullname,
+		       struct ccf_entry *e, int *type, char *path)
+{
+	struct search_order *so;
+	size_t len;
+
+	if (!module_path(self, fullname, path)) {
+		return 0;
+	}
+	switch (find_indexed(self, fullname, e, type)) {
+	case 1:
+		return 1;
+	case 0:
+		return 0;
+	}
+
+	len = strlen(path);
+	for (so = searchorder; *so->suffix; so++) {
+		const struct ccf_entry *found;
+
+		if (!usable(so->type)) {
+			continue;
+		}
+		strcpy(path + len, so->suffix);
+		found = ccf_archive_find(the_archive, path, strlen(path));
+		if (found) {
+			path[len] = 0;
+			*e = *found;
+			*type = so->type;
+			return 1;
+		}
+	}
+	path[len] = 0;
+	return 0;
+}
+
+// a C extension linked into the loader under a dotted name, see setup.py
+// --static-extensions. Python looks up nothing but top level names in the
+// inittab, so the importer of the package loads these.
+static struct _inittab *find_builtin(const char *fullname)
+{
+	struct _inittab *p;
+
+	if (!strchr(fullname, '.')) {
+		return 0;
+	}
+	for (p = PyImport_Inittab; p->name; p++) {
+		if (strcmp(p->name, fullname) == 0) {
+			return p;
+		}
+	}
+	return 0;
+}
+
+static PyObject *load_builtin(struct _inittab *p, const char *fullname)
+{
+	PyObject *modules = PyImport_GetModuleDict(), *mod;
+	char *context;
+
+	mod = PyDict_GetItemString(modules, fullname);
+	if (mod) {
+		Py_INCREF(mod);
+		return mod;
+	}
+	// Py_InitModule takes the full name from here, as it does for a
+	// dlopen()ed extension
+	context = _Py_PackageContext;
+	_Py_PackageContext = (char *)fullname;
+	p->initfunc();
+	_Py_PackageContext = context;
+	if (PyErr_Occurred()) {
+		return 0;
+	}
+	mod = PyDict_GetItemString(modules, fullname);
+	if (!mod) {
+		PyErr_Format(PyExc_SystemError, "initialization of %s did not create the module",
+			     fullname);
+		return 0;
+	}
+	if (_PyImport_FixupExtension((char *)fullname, (char *)fullname) == 0) {
+		return 0;
+	}
+	Py_INCREF(mod);
+	return mod;
+}
+
+static int magic_ok(const char *data)
+{
+	long magic = PyImport_GetMagicNumber();
+	const unsigned char *p = (const unsigned char *)data;
+
+	return p[0] == (magic & 0xff) && p[1] == ((magic >> 8) & 0xff)
+		&& p[2] == ((magic >> 16) & 0xff) && p[3] == ((magic >> 24) & 0xff);
+}
+
+static PyObject *unmarshal_code(const struct ccf_entry *e, const char *data, size_t size)
+{
+	PyObject *code;
+
+	if (size < 8 || !magic_ok(data)) {
+		// bad magic, fall through to the next candidate like zipimport
+		Py_INCREF(Py_None);
+		return Py_None;
+	}
+	code = PyMarshal_ReadObjectFromString((char *)data + 8, size - 8);
+	if (code && !PyCode_Check(code)) {
+		Py_DECREF(code);
+		set_entry_error(PyExc_TypeError, "compiled module %s is not a code object", e, 0);
+		return 0;
+	}
+	return code;
+}
+
+static PyObject *compile_source(const char *pathname, const char *data, size_t size)
+{
+	PyObject *code;
+	char *buf, *q;
+	size_t i;
+
+	// the tokenizer wants \n line endings and a trailing newline
+	buf = PyMem_Malloc(size + 2);
+	if (!buf) {
+		return PyErr_NoMemory();
+	}
+	for (i = 0, q = buf; i < size; i++) {
+		if (data[i] == '\r') {
+			*q++ = '\n';
+			if (i + 1 < size && data[i + 1] == '\n') {
+				i++;
+			}
+		} else {
+			*q++ = data[i];
+		}
+	}
+	*q++ = '\n';
+	*q = 0;
+	code = Py_CompileString(buf, pathname, Py_file_input);
+	PyMem_Free(buf);
+	return code;
+}
+
+// archive path of an entry, to be free()d
+static char *entry_path(const struct ccf_entry *e)
+{
+	char *p = malloc(strlen(the_archive->path) + e->name_len + 2);
+
+	if (p) {
+		sprintf(p, "%s%c%.*s", the_archive->path, SEP, (int)e->name_len, e->name);
+	}
+	return p;
+}
+
+// code object of an entry, None if it's bytecode with a bad magic number
+static PyObject *entry_code(const struct ccf_entry *e, int type, char **modpath)
+{
+	struct entry_data d;
+	PyObject *code;
+	long long t = 0;
+	char *p;
+
+	p = entry_path(e);
+	if (!p) {
+		return PyErr_NoMemory();
+	}
+
+	if (loading) {
+		const unsigned char *raw;
+
+		t = ccf_now();
+		raw = ccf_entry_raw(the_archive, e);
+		if (raw) {
+			ccf_trace_touch(raw, e->csize);
+		}
+		loading->read_ns += ccf_now() - t;
+		loading->entry = e->name;
+		loading->entry_len = e->name_len;
+		loading->csize = e->csize;
+		loading->usize = e->usize;
+		t = ccf_now();
+	}
+	if (entry_data_get(e, &d) != 0) {
+		free(p);
+		return 0;
+	}
+	if (loading) {
+		loading->decompress_ns += ccf_now() - t;
+		t = ccf_now();
+	}
+	if (type & IS_BYTECODE) {
+		code = unmarshal_code(e, d.data, d.size);
+	} else {
+		code = compile_source(p, d.data, d.size);
+	}
+	entry_data_release(&d);
+	if (loading) {
+		loading->unmarshal_ns += ccf_now() - t;
+	}
+
+	if (!code || code == Py_None) {
+		free(p);
+		return code;
+	}
+	*modpath = p;
+	return code;
+}
+
+// an extension has no code, returns None and its entry in *ext
+static PyObject *extension_entry(const struct ccf_entry *e, struct ccf_entry *ext,
+				 char **modpath)
+{
+	*modpath = entry_path(e);
+	if (!*modpath) {
+		return PyErr_NoMemory();
+	}
+	if (ext) {
+		*ext = *e;
+	}
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+// code object of fullname, None for an extension module
+static PyObject *get_module_code(ArchiveImporter *self, const char *fullname,
+				 int *ispackage, char **modpath, struct ccf_entry *ext)
+{
+	char path[MAXPATHLEN + 1];
+	struct search_order *so;
+	struct ccf_entry ie;
+	PyObject *code;
+	size_t len;
+	int type;
+
+	if (!module_path(self, fullname, path)) {
+		goto notfound;
+	}
+	switch (find_indexed(self, fullname, &ie, &type)) {
+	case 0:
+		goto notfound;
+	case 1:
+		if (type & IS_EXTENSION) {
+			*ispackage = 0;
+			return extension_entry(&ie, ext, modpath);
+		}
+		code = entry_code(&ie, type, modpath);
+		if (code != Py_None) {
+			*ispackage = (type & IS_PACKAGE) != 0;
+			return code;
+		}
+		// stale bytecode, search like zipimport would
+		Py_DECREF(code);
+		break;
+	}
+
+	len = strlen(path);
+	for (so = searchorder; *so->suffix; so++) {
+		const struct ccf_entry *e;
+
+		if (!usable(so->type)) {
+			continue;
+		}
+		strcpy(path + len, so->suffix);
+		e = ccf_archive_find(the_archive, path, strlen(path));
+		if (!e) {
+			continue;
+		}
+		if (so->type & IS_EXTENSION) {
+			*ispackage = 0;
+			return extension_entry(e, ext, modpath);
+		}
+		code = entry_code(e, so->type, modpath);
+		if (code == Py_None) {
+			Py_DECREF(code);
+			continue;
+		}
+		*ispackage = (so->type & IS_PACKAGE) != 0;
+		return code;
+	}
+
+notfound:
+	PyErr_Format(PyExc_ImportError, "can't find module '%.200s'", fullname);
+	return 0;
+}
+
+static int archiveimporter_init(ArchiveImporter *self, PyObject *args, PyObject *kwds)
+{
+	char *path;
+	size_t prefix_len;
+	PyObject *prefix;
+
+	if (!_PyArg_NoKeywords("archiveimporter()", kwds)) {
+		return -1;
+	}
+	if (!PyArg_ParseTuple(args, "s:archiveimporter", &path)) {
+		return -1;
+	}
+	if (!is_archive_path(path, &prefix_len)) {
+		PyErr_SetString(PyExc_ImportError, "not the loader's archive");
+		return -1;
+	}
+	if (prefix_len) {
+		prefix = PyString_FromFormat("%s%c", path + strlen(path) - prefix_len, SEP);
+	} else {
+		prefix = PyString_FromString("");
+	}
+	if (!prefix) {
+		return -1;
+	}
+	Py_XDECREF(self->prefix);
+	self->prefix = prefix;
+	Py_XDECREF(self->archive);
+	self->archive = PyString_FromString(the_archive->path);
+	return self->archive ? 0 : -1;
+}
+
+static void archiveimporter_dealloc(ArchiveImporter *self)
+{
+	Py_XDECREF(self->archive);
+	Py_XDECREF(self->prefix);
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static PyObject *archiveimporter_repr(ArchiveImporter *self)
+{
+	if (!self->archive) {
+		return PyString_FromString("<archiveimporter object \"???\">");
+	}
+	if (PyString_GET_SIZE(self->prefix)) {
+		return PyString_FromFormat("<archiveimporter object \"%s%c%s\">",
+					   PyString_AS_STRING(self->archive), SEP,
+					   PyString_AS_STRING(self->prefix));
+	}
+	return PyString_FromFormat("<archiveimporter object \"%s\">",
+				   PyString_AS_STRING(self->archive));
+}
+
+static PyObject *archiveimporter_find_module(ArchiveImporter *self, PyObject *args)
+{
+	char path[MAXPATHLEN + 1];
+	struct ccf_entry e;
+	PyObject *unused = 0;
+	char *fullname;
+	int type;
+
+	if (!PyArg_ParseTuple(args, "s|O:archiveimporter.find_module", &fullname, &unused)) {
+		return 0;
+	}
+	if (find_builtin(fullname) || find_module(self, fullname, &e, &type, path)) {
+		Py_INCREF(self);
+		return (PyObject *)self;
+	}
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+// dlopen() an extension module out of the archive, see extension.h
+static PyObject *load_extension(ArchiveImporter *self, const char *fullname,
+				const struct ccf_entry *e, const char *modpath)
+{
+	PyObject *imp, *mod, *file;
+	char fdpath[64];
+	int fd;
+
+	fd = ccf_extension_fd(the_archive, e);
+	if (fd < 0) {
+		PyErr_Format(PyExc_ImportError, "can't load %s: %s", modpath, strerror(errno));
+		return 0;
+	}
+	sprintf(fdpath, "/proc/self/fd/%d", fd);
+	imp = PyImport_ImportModuleNoBlock("imp");
+	if (!imp) {
+		return 0;
+	}
+	mod = PyObject_CallMethod(imp, "load_dynamic", "ss", fullname, fdpath);
+	Py_DECREF(imp);
+	if (!mod) {
+		return 0;
+	}
+	// as if it had been loaded from the archive
+	file = PyString_FromString(modpath);
+	if (!file || PyObject_SetAttrString(mod, "__file__", file) != 0
+	    || PyObject_SetAttrString(mod, "__loader__", (PyObject *)self) != 0) {
+		PyErr_Clear();
+	}
+	Py_XDECREF(file);
+	return mod;
+}
+
+static PyObject *load_module(ArchiveImporter *self, const char *fullname,
+			     struct ccf_trace_frame *frame)
+{
+	PyObject *code, *mod, *dict;
+	struct _inittab *builtin;
+	struct ccf_entry ext;
+	char *modpath;
+	int ispackage;
+
+	builtin = find_builtin(fullname);
+	if (builtin) {
+		return load_builtin(builtin, fullname);
+	}
+	loading = frame;
+	code = get_module_code(self, fullname, &ispackage, &modpath, &ext);
+	loading = 0;
+	if (!code) {
+		return 0;
+	}
+	if (code == Py_None) {
+		Py_DECREF(code);
+		mod = load_extension(self, fullname, &ext, modpath);
+		free(modpath);
+		return mod;
+	}
+
+	mod = PyImport_AddModule(fullname);
+	if (!mod) {
+		goto error;
+	}
+	dict = PyModule_GetDict(mod);
+	if (PyDict_SetItemString(dict, "__loader__", (PyObject *)self) != 0) {
+		goto error;
+	}
+	if (ispackage) {
+		PyObject *pkgdir, *pkgpath;
+		int err;
+
+		pkgdir = PyString_FromFormat("%s%c%s%s",
+			PyString_AS_STRING(self->archive), SEP,
+			PyString_AS_STRING(self->prefix), get_subname(fullname));
+		if (!pkgdir) {
+			goto error;
+		}
+		pkgpath = Py_BuildValue("[N]", pkgdir);
+		if (!pkgpath) {
+			goto error;
+		}
+		err = PyDict_SetItemString(dict, "__path__", pkgpath);
+		Py_DECREF(pkgpath);
+		if (err != 0) {
+			goto error;
+		}
+	}
+	if (frame) {
+		frame->exec_start = ccf_now();
+	}
+	mod = PyImport_ExecCodeModuleEx((char *)fullname, code, modpath);
+	Py_DECREF(code);
+	free(modpath);
+	return mod;
+
+error:
+	Py_DECREF(code);
+	free(modpath);
+	return 0;
+}
+
+static PyObject *archiveimporter_load_module(ArchiveImporter *self, PyObject *args)
+{
+	struct ccf_trace_frame *frame;
+	PyObject *mod;
+	char *fullname;
+
+	if (!PyArg_ParseTuple(args, "s:archiveimporter.load_module", &fullname)) {
+		return 0;
+	}
+	frame = ccf_trace_push(fullname);
+	mod = load_module(self, fullname, frame);
+	if (frame) {
+		ccf_trace_pop(frame, mod != 0);
+	}
+	return mod;
+}
+
+static PyObject *archiveimporter_get_code(ArchiveImporter *self, PyObject *args)
+{
+	PyObject *code;
+	char *fullname, *modpath;
+	int ispackage;
+
+	if (!PyArg_ParseTuple(args, "s:archiveimporter.get_code", &fullname)) {
+		return 0;
+	}
+	code = get_module_code(self, fullname, &ispackage, &modpath, 0);
+	if (code) {
+		free(modpath);
+	}
+	return code;
+}
+
+static PyObject *archiveimporter_get_filename(ArchiveImporter *self, PyObject *args)
+{
+	PyObject *code, *res;
+	char *fullname, *modpath;
+	int ispackage;
+
+	if (!PyArg_ParseTuple(args, "s:archiveimporter.get_filename", &fullname)) {
+		return 0;
+	}
+	code = get_module_code(self, fullname, &ispackage, &modpath, 0);
+	if (!code) {
+		return 0;
+	}
+	Py_DECREF(code);
+	res = PyString_FromString(modpath);
+	free(modpath);
+	return res;
+}
+
+static PyObject *archiveimporter_is_package(ArchiveImporter *self, PyObject *args)
+{
+	char path[MAXPATHLEN + 1];
+	struct ccf_entry e;
+	char *fullname;
+	int type;
+
+	if (!PyArg_ParseTuple(args, "s:archiveimporter.is_package", &fullname)) {
+		return 0;
+	}
+	if (!find_module(self, fullname, &e, &type, path)) {
+		PyErr_Format(PyExc_ImportError, "can't find module '%.200s'", fullname);
+		return 0;
+	}
+	return PyBool_FromLong(type & IS_PACKAGE);
+}
+
+static PyObject *archiveimporter_get_source(ArchiveImporter *self, PyObject *args)
+{
+	char path[MAXPATHLEN + 1];
+	const struct ccf_entry *e;
+	struct ccf_entry me;
+	struct entry_data d;
+	PyObject *res;
+	char *fullname;
+	int type;
+
+	if (!PyArg_ParseTuple(args, "s:archiveimporter.get_source", &fullname)) {
+		return 0;
+	}
+	if (!find_module(self, fullname, &me, &type, path)) {
+		PyErr_Format(PyExc_ImportError, "can't find module '%.200s'", fullname);
+		return 0;
+	}
+	strcat(path, (type & IS_PACKAGE) ? "/__init__.py" : ".py");
+	e = ccf_archive_find(the_archive, path, strlen(path));
+	if (!e) {
+		Py_INCREF(Py_None);
+		return Py_None;
+	}
+	if (entry_data_get(e, &d) != 0) {
+		return 0;
+	}
+	res = PyString_FromStringAndSize(d.data, d.size);
+	entry_data_release(&d);
+	return res;
+}
+
+static PyObject *archiveimporter_get_data(ArchiveImporter *self, PyObject *args)
+{
+	const struct ccf_entry *e;
+	struct entry_data d;
+	PyObject *res;
+	char *path;
+	size_t n = strlen(the_archive->path);
+
+	if (!PyArg_ParseTuple(args, "s:archiveimporter.get_data", &path)) {
+		return 0;
+	}
+	if (strncmp(path, the_archive->path, n) == 0 && path[n] == SEP) {
+		path += n + 1;
+	}
+	e = ccf_archive_find(the_archive, path, strlen(path));
+	if (!e) {
+		PyErr_SetFromErrnoWithFilename(PyExc_IOError, path);
+		return 0;
+	}
+	if (entry_data_get(e, &d) != 0) {
+		return 0;
+	}
+	res = PyString_FromStringAndSize(d.data, d.size);
+	entry_data_release(&d);
+	return res;
+}
+
+static PyMethodDef archiveimporter_methods[] = {
+	{"find_module", (PyCFunction)archiveimporter_find_module, METH_VARARGS,
+	 "find_module(fullname, path=None) -> self or None."},
+	{"load_module", (PyCFunction)archiveimporter_load_module, METH_VARARGS,
+	 "load_module(fullname) -> module."},
+	{"get_code", (PyCFunction)archiveimporter_get_code, METH_VARARGS,
+	 "get_code(fullname) -> code object."},
+	{"get_data", (PyCFunction)archiveimporter_get_data, METH_VARARGS,
+	 "get_data(pathname) -> string with file data."},
+	{"get_source", (PyCFunction)archiveimporter_get_source, METH_VARARGS,
+	 "get_source(fullname) -> source string or None."},
+	{"get_filename", (PyCFunction)archiveimporter_get_filename, METH_VARARGS,
+	 "get_filename(fullname) -> filename string."},
+	{"is_package", (PyCFunction)archiveimporter_is_package, METH_VARARGS,
+	 "is_package(fullname) -> bool."},
+	{NULL, NULL}
+};
+
+static PyMemberDef archiveimporter_members[] = {
+	{"archive", T_OBJECT, offsetof(ArchiveImporter, archive), READONLY},
+	{"prefix", T_OBJECT, offsetof(ArchiveImporter, prefix), READONLY},
+	{NULL}
+};
+
+static PyTypeObject ArchiveImporter_Type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	"_ccfreeze.archiveimporter",
+	sizeof(ArchiveImporter),
+	0,					/* tp_itemsize */
+	(destructor)archiveimporter_dealloc,	/* tp_dealloc */
+	0,					/* tp_print */
+	0,					/* tp_getattr */
+	0,					/* tp_setattr */
+	0,					/* tp_compare */
+	(reprfunc)archiveimporter_repr,		/* tp_repr */
+	0,					/* tp_as_number */
+	0,					/* tp_as_sequence */
+	0,					/* tp_as_mapping */
+	0,					/* tp_hash */
+	0,					/* tp_call */
+	0,					/* tp_str */
+	PyObject_GenericGetAttr,		/* tp_getattro */
+	0,					/* tp_setattro */
+	0,					/* tp_as_buffer */
+	Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE, /* tp_flags */
+	"archiveimporter(archivepath) -> archiveimporter object\n\n"
+	"Import modules from the loader's memory mapped archive.",
+	0,					/* tp_traverse */
+	0,					/* tp_clear */
+	0,					/* tp_richcompare */
+	0,					/* tp_weaklistoffset */
+	0,					/* tp_iter */
+	0,					/* tp_iternext */
+	archiveimporter_methods,		/* tp_methods */
+	archiveimporter_members,		/* tp_members */
+	0,					/* tp_getset */
+	0,					/* tp_base */
+	0,					/* tp_dict */
+	0,					/* tp_descr_get */
+	0,					/* tp_descr_set */
+	0,					/* tp_dictoffset */
+	(initproc)archiveimporter_init,		/* tp_init */
+	PyType_GenericAlloc,			/* tp_alloc */
+	PyType_GenericNew,			/* tp_new */
+	PyObject_Del,				/* tp_free */
+};
+
+// data files in the archive, see _ccfreeze.resource()
+typedef struct {
+	PyObject_HEAD
+	const char *data;
+	Py_ssize_t size;
+	void *buf;		// inflated data, shared by all views
+	PyObject *obj;		// string inflated by the zlib module
+	PyObject *weakreflist;
+} Resource;
+
+// member name -> weak reference to its Resource, for inflated members
+static PyObject *resources = 0;
+
+static int resource_getbuffer(Resource *self, Py_buffer *view, int flags)
+{
+	return PyBuffer_FillInfo(view, (PyObject *)self, (void *)self->data,
+				 self->size, 1, flags);
+}
+
+static PyBufferProcs resource_as_buffer = {
+	0,					/* bf_getreadbuffer */
+	0,					/* bf_getwritebuffer */
+	0,					/* bf_getsegcount */
+	0,					/* bf_getcharbuffer */
+	(getbufferproc)resource_getbuffer,	/* bf_getbuffer */
+	0,					/* bf_releasebuffer */
+};
+
+static void resource_dealloc(Resource *self)
+{
+	if (self->weakreflist) {
+		PyObject_ClearWeakRefs((PyObject *)self);
+	}
+	free(self->buf);
+	Py_XDECREF(self->obj);
+	PyObject_Del(self);
+}
+
+static PyTypeObject Resource_Type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	"_ccfreeze.resource",
+	sizeof(Resource),
+	0,					/* tp_itemsize */
+	(destructor)resource_dealloc,		/* tp_dealloc */
+	0,					/* tp_print */
+	0,					/* tp_getattr */
+	0,					/* tp_setattr */
+	0,					/* tp_compare */
+	0,					/* tp_repr */
+	0,					/* tp_as_number */
+	0,					/* tp_as_sequence */
+	0,					/* tp_as_mapping */
+	0,					/* tp_hash */
+	0,					/* tp_call */
+	0,					/* tp_str */
+	0,					/* tp_getattro */
+	0,					/* tp_setattro */
+	&resource_as_buffer,			/* tp_as_buffer */
+	Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_NEWBUFFER, /* tp_flags */
+	"owner of the memory behind the views _ccfreeze.resource() returns",
+	0,					/* tp_traverse */
+	0,					/* tp_clear */
+	0,					/* tp_richcompare */
+	offsetof(Resource, weakreflist),	/* tp_weaklistoffset */
+};
+
+static Resource *resource_new(const struct ccf_entry *e)
+{
+	struct entry_data d;
+	Resource *res;
+
+	if (entry_data_get(e, &d) != 0) {
+		return 0;
+	}
+	res = PyObject_New(Resource, &Resource_Type);
+	if (!res) {
+		entry_data_release(&d);
+		return 0;
+	}
+	res->data = d.data;
+	res->size = d.size;
+	res->buf = d.buf;
+	res->obj = d.obj;
+	res->weakreflist = 0;
+	return res;
+}
+
+// the Resource of an inflated member, shared for as long as a view of it
+// is alive
+static Resource *cached_resource(const struct ccf_entry *e, PyObject *key)
+{
+	PyObject *ref;
+	Resource *res;
+
+	if (!resources && !(resources = PyDict_New())) {
+		return 0;
+	}
+	ref = PyDict_GetItem(resources, key);
+	if (ref && PyWeakref_GetObject(ref) != Py_None) {
+		res = (Resource *)PyWeakref_GetObject(ref);
+		Py_INCREF(res);
+		return res;
+	}
+	res = resource_new(e);
+	if (!res) {
+		return 0;
+	}
+	ref = PyWeakref_NewRef((PyObject *)res, 0);
+	if (!ref || PyDict_SetItem(resources, key, ref) != 0) {
+		PyErr_Clear();
+	}
+	Py_XDECREF(ref);
+	return res;
+}
+
+static PyObject *ccfreeze_resource(PyObject *module, PyObject *args)
+{
+	const struct ccf_entry *e;
+	PyObject *key, *view;
+	Resource *res;
+	char *path;
+	size_t n;
+
+	if (!PyArg_ParseTuple(args, "s:resource", &path)) {
+		return 0;
+	}
+	if (!the_archive) {
+		PyErr_SetString(PyExc_IOError, "the archive is not mapped");
+		return 0;
+	}
+	n = strlen(the_archive->path);
+	if (strncmp(path, the_archive->path, n) == 0 && path[n] == SEP) {
+		path += n + 1;
+	}
+	e = ccf_archive_find(the_archive, path, strlen(path));
+	if (!e) {
+		errno = ENOENT;
+		PyErr_SetFromErrnoWithFilename(PyExc_IOError, path);
+		return 0;
+	}
+	if (e->method == CCF_STORED) {
+		res = resource_new(e);
+	} else {
+		key = PyString_FromStringAndSize(e->name, e->name_len);
+		res = key ? cached_resource(e, key) : 0;
+		Py_XDECREF(key);
+	}
+	if (!res) {
+		return 0;
+	}
+	view = PyMemoryView_FromObject((PyObject *)res);
+	Py_DECREF(res);
+	return view;
+}
+
+static PyObject *fallback_importer(const char *path)
+{
+	PyObject *zipimport, *importer;
+
+	zipimport = PyImport_ImportModule("zipimport");
+	if (!zipimport) {
+		return 0;
+	}
+	importer = PyObject_CallMethod(zipimport, "zipimporter", "s", path);
+	Py_DECREF(zipimport);
+	return importer;
+}
+
+// Py_Initialize could not import encodings yet (see Py_GetPath() in
+// getpath.c), set up the locale's codec the way Py_InitializeEx does
+void ccf_init_encodings(void)
+{
+	static const char *streams[] = {"stdin", "stdout", "stderr"};
+	PyObject *mod;
+	int i;
+
+	mod = PyImport_ImportModule("encodings");
+	if (!mod) {
+		PyErr_Clear();
+		return;
+	}
+	Py_DECREF(mod);
+
+#if defined(Py_USING_UNICODE) && defined(HAVE_LANGINFO_H) && defined(CODESET)
+	{
+		char *saved_locale, *codeset;
+		PyObject *enc;
+
+		saved_locale = strdup(setlocale(LC_CTYPE, NULL));
+		setlocale(LC_CTYPE, "");
+		codeset = nl_langinfo(CODESET);
+		codeset = codeset && *codeset ? strdup(codeset) : 0;
+		setlocale(LC_CTYPE, saved_locale);
+		free(saved_locale);
+		if (!codeset) {
+			return;
+		}
+
+		enc = PyCodec_Encoder(codeset);
+		if (!enc) {
+			PyErr_Clear();
+			free(codeset);
+			return;
+		}
+		Py_DECREF(enc);
+
+		for (i = 0; i < 3; i++) {
+			PyObject *f = PySys_GetObject((char *)streams[i]);
+			if (f && PyFile_Check(f) && PyFile_AsFile(f)
+			    && isatty(fileno(PyFile_AsFile(f)))
+			    && !PyFile_SetEncodingAndErrors(f, codeset, NULL)) {
+				PyErr_Clear();
+			}
+		}
+		if (!Py_FileSystemDefaultEncoding) {
+			Py_FileSystemDefaultEncoding = codeset;
+		} else {
+			free(codeset);
+		}
+	}
+#endif
+}
+
+// the wrapped posix function, after ccf_startup_done()
+static PyObject *startup_done_and_call(PyObject *func, PyObject *args)
+{
+	ccf_startup_done();
+	return PyObject_Call(func, args, 0);
+}
+
+static PyMethodDef fork_def = {"fork", startup_done_and_call, METH_VARARGS, 0};
+static PyMethodDef forkpty_def = {"forkpty", startup_done_and_call, METH_VARARGS, 0};
+
+// the first fork ends startup whether or not the program said so. Done
+// before os copies the functions of posix.
+static void wrap_fork(void)
+{
+	PyMethodDef *defs[] = {&fork_def, &forkpty_def};
+	PyObject *posix, *func, *wrapper;
+	size_t i;
+
+	posix = PyImport_ImportModule("posix");
+	for (i = 0; posix && i < sizeof(defs) / sizeof(defs[0]); i++) {
+		func = PyObject_GetAttrString(posix, defs[i]->ml_name);
+		if (!func || !PyCFunction_Check(func)) {
+			Py_XDECREF(func);
+			continue;
+		}
+		defs[i]->ml_doc = ((PyCFunctionObject *)func)->m_ml->ml_doc;
+		wrapper = PyCFunction_New(defs[i], func);
+		if (wrapper) {
+			PyObject_SetAttrString(posix, defs[i]->ml_name, wrapper);
+			Py_DECREF(wrapper);
+		}
+		Py_DECREF(func);
+	}
+	Py_XDECREF(posix);
+	PyErr_Clear();
+}
+
+static PyObject *ccfreeze_install(PyObject *module, PyObject *args)
+{
+	PyObject *importer, *hooks, *cache;
+	char *path;
+
+	if (!PyArg_ParseTuple(args, "s:install", &path)) {
+		return 0;
+	}
+	if (!ccf_loader_archive) {
+		ccf_loader_archive = ccf_archive_open(path);
+	}
+	the_archive = ccf_loader_archive;
+	if (!the_archive || strcmp(path, the_archive->path) != 0) {
+		// not something we can map, e.g. a zip64 archive
+		return fallback_importer(path);
+	}
+
+	importer = PyObject_CallFunction((PyObject *)&ArchiveImporter_Type, "s", path);
+	if (!importer) {
+		return 0;
+	}
+
+	// seed the cache so sys.path[0] is never handed to zipimport, and hook
+	// in front of zipimport for the package directories inside the archive
+	hooks = PySys_GetObject("path_hooks");
+	cache = PySys_GetObject("path_importer_cache");
+	if (!hooks || !PyList_Check(hooks) || !cache || !PyDict_Check(cache)
+	    || PyList_Insert(hooks, 0, (PyObject *)&ArchiveImporter_Type) != 0
+	    || PyDict_SetItemString(cache, path, importer) != 0) {
+		Py_DECREF(importer);
+		PyErr_SetString(PyExc_ImportError, "can't install archive importer");
+		return 0;
+	}
+	ccf_init_encodings();
+	wrap_fork();
+	return importer;
+}
+
+void ccf_startup_done(void)
+{
+	ccf_prefetch_stop();
+	ccf_alloc_startup_done();
+	ccf_gc_freeze();
+}
+
+static PyObject *ccfreeze_startup_done(PyObject *module, PyObject *unused)
+{
+	ccf_startup_done();
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static PyObject *ccfreeze_memory_info(PyObject *module, PyObject *unused)
+{
+	struct ccf_memory_info m;
+
+	if (!ccf_memory_info(&m)) {
+		Py_INCREF(Py_None);
+		return Py_None;
+	}
+	return Py_BuildValue("{s:n,s:n,s:n,s:n,s:n,s:n,s:n}",
+			     "rss", (Py_ssize_t)m.rss,
+			     "pss", (Py_ssize_t)m.pss,
+			     "shared_clean", (Py_ssize_t)m.shared_clean,
+			     "shared_dirty", (Py_ssize_t)m.shared_dirty,
+			     "private_clean", (Py_ssize_t)m.private_clean,
+			     "private_dirty", (Py_ssize_t)m.private_dirty,
+			     "swap", (Py_ssize_t)m.swap);
+}
+
+static PyObject *ccfreeze_malloc_info(PyObject *module, PyObject *unused)
+{
+	struct ccf_alloc_info a;
+
+	if (!ccf_alloc_info(&a)) {
+		Py_INCREF(Py_None);
+		return Py_None;
+	}
+	return Py_BuildValue("{s:n,s:n,s:n,s:n,s:n,s:n,s:n}",
+			     "heap_bytes", (Py_ssize_t)a.heap_bytes,
+			     "used_bytes", (Py_ssize_t)a.used_bytes,
+			     "free_bytes", (Py_ssize_t)a.free_bytes,
+			     "free_blocks", (Py_ssize_t)a.free_blocks,
+			     "releasable_bytes", (Py_ssize_t)a.releasable_bytes,
+			     "mmap_bytes", (Py_ssize_t)a.mmap_bytes,
+			     "mmap_blocks", (Py_ssize_t)a.mmap_blocks);
+}
+
+static PyMethodDef ccfreeze_methods[] = {
+	{"install", ccfreeze_install, METH_VARARGS,
+	 "install(archivepath) -> importer\n\n"
+	 "Map archivepath and register an importer for it in sys.path_hooks."},
+	{"startup_done", ccfreeze_startup_done, METH_NOARGS,
+	 "startup_done()\n\n"
+	 "Tell the loader that the program has started: give back the unused part\n"
+	 "of the startup arena (allocator option) and freeze the objects alive\n"
+	 "(gc option). os.fork() and os.forkpty() call it if the program did not."},
+	{"malloc_info", ccfreeze_malloc_info, METH_NOARGS,
+	 "malloc_info() -> dict or None\n\n"
+	 "Counters of the malloc heap."},
+	{"resource", ccfreeze_resource, METH_VARARGS,
+	 "resource(pathname) -> memoryview\n\n"
+	 "Read-only view of a file in the archive. Stored files are viewed in the\n"
+	 "archive's mapping, compressed ones are inflated once and shared by the\n"
+	 "views alive at the same time. pathname is relative to the archive or\n"
+	 "starts with its path, like for get_data()."},
+	{"memory_info", ccfreeze_memory_info, METH_NOARGS,
+	 "memory_info() -> dict or None\n\n"
+	 "Shared and private pages of this process in bytes, from /proc/self/smaps."},
+	{NULL, NULL}
+};
+
+PyMODINIT_FUNC init_ccfreeze(void)
+{
+	PyObject *mod;
+
+	if (PyType_Ready(&ArchiveImporter_Type) < 0 || PyType_Ready(&Resource_Type) < 0) {
+		return;
+	}
+	mod = Py_InitModule3("_ccfreeze", ccfreeze_methods,
+			     "support module for frozen programs");
+	if (!mod) {
+		return;
+	}
+	Py_INCREF(&ArchiveImporter_Type);
+	PyModule_AddObject(mod, "archiveimporter", (PyObject *)&ArchiveImporter_Type);
+}
@@ -0,0 +1,19 @@
+// native importer for the library archive (the _ccfreeze module)
+
+#ifndef CCFREEZE_IMPORTER_H
+#define CCFREEZE_IMPORTER_H
+
+#include <Python.h>
+
+PyMODINIT_FUNC init_ccfreeze(void);
+
+// set the encoding of stdio streams connected to a terminal and the file
+// system encoding from the locale, done by _ccfreeze.install()
+void ccf_init_encodings(void);
+
+// the program has started, done by _ccfreeze.startup_done(), by the first
+// os.fork() and before a zygote forks: see alloc.h, gcfreeze.h and
+// prefetch.h
+void ccf_startup_done(void);
+
+#endif
@@ -21,9 +21,45 @@
 #include <stdlib.h>
 #endif
 
+#ifndef WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "alloc.h"
+#include "batch.h"
+#include "gcfreeze.h"
+#include "getpath.h"
+#include "importer.h"
+#include "options.h"
+#include "prefetch.h"
+#include "record.h"
+#include "report.h"
+#include "shmcache.h"
+#include "trace.h"
+#include "zygote.h"
+#else
+#define ccf_phase_begin(phase)
+#define ccf_phase_end(phase)
+#define ccf_prefetch_stop()
+#define ccf_gc_resume()
+#endif
+
+#ifdef CCF_FROZEN_MODULES
+// generated by setup.py build_ext --frozen-modules
+extern struct _frozen ccf_frozen_modules[];
+#endif
+
+#ifdef CCF_STATIC_EXTENSIONS
+// generated by setup.py build_ext --static-extensions
+extern struct _inittab ccf_static_extensions[];
+#endif
 
 static void fatal(const char *message)
 {
+	fflush(stdout);
 #ifdef GUI
 	MessageBox(NULL, message, "ccfreeze Fatal Error", MB_ICONERROR);
 #else
@@ -56,6 +92,231 @@ static void compute_syspath(void)
 }
 #endif
 
+static void finalized(void)
+{
+	ccf_prefetch_stop();
+	ccf_phase_end(CCF_PHASE_FINALIZE);
+}
+
+static PyObject *run_main(PyObject *locals)
+{
+	PyObject *importer, *code, *res;
+
+	ccf_phase_begin(CCF_PHASE_MAIN_CODE);
+	importer = PyDict_GetItemString(locals, "importer");
+	code = PyObject_CallMethod(importer, "get_code", "s", "__main__");
+	ccf_phase_end(CCF_PHASE_MAIN_CODE);
+	if (!code) {
+		return 0;
+	}
+	if (!PyCode_Check(code)) {
+		Py_DECREF(code);
+		PyErr_SetString(PyExc_TypeError, "__main__ is not a code object");
+		return 0;
+	}
+
+	ccf_phase_begin(CCF_PHASE_MAIN);
+	res = PyEval_EvalCode((PyCodeObject *)code, locals, locals);
+	ccf_phase_end(CCF_PHASE_MAIN);
+	// startup is over, drop what the importer did not take and collect
+	// again if the program did not say so itself
+	ccf_prefetch_stop();
+	ccf_gc_resume();
+	Py_DECREF(code);
+	return res;
+}
+
+#ifndef WIN32
+// the status PyErr_Print would exit with for the pending SystemExit
+static int system_exit_status(void)
+{
+	PyObject *type, *value, *tb, *code, *err;
+	int status = 0;
+
+	PyErr_Fetch(&type, &value, &tb);
+	if (value && PyExceptionInstance_Check(value)) {
+		code = PyObject_GetAttrString(value, "code");
+		if (code) {
+			Py_DECREF(value);
+			value = code;
+		}
+	}
+	if (!value || value == Py_None) {
+		status = 0;
+	} else if (PyInt_Check(value)) {
+		status = (int)PyInt_AsLong(value);
+	} else {
+		err = PySys_GetObject("stderr");
+		if (err && err != Py_None) {
+			PyFile_WriteObject(value, err, Py_PRINT_RAW);
+		} else {
+			PyObject_Print(value, stderr, Py_PRINT_RAW);
+		}
+		PySys_WriteStderr("\n");
+		status = 1;
+	}
+	Py_XDECREF(type);
+	Py_XDECREF(value);
+	Py_XDECREF(tb);
+	PyErr_Clear();
+	return status;
+}
+
+static void flush_file(const char *name)
+{
+	PyObject *f = PySys_GetObject((char *)name), *res;
+
+	if (f && f != Py_None) {
+		res = PyObject_CallMethod(f, "flush", "");
+		Py_XDECREF(res);
+	}
+	PyErr_Clear();
+}
+
+// with the exit=fast option, the program leaves without Py_Finalize: the
+// non-daemon threads are joined, atexit handlers run and output is flushed
+// as usual, io.open() objects included, but modules and objects are not
+// torn down one by one
+static int exit_fast(void)
+{
+	const char *mode = ccf_option("exit");
+
+	return mode && strcmp(mode, "fast") == 0;
+}
+
+// objects of io.open() buffer in Python, not in stdio: flush the live
+// ones. Returns the number of objects the collector tracks, which
+// Py_Finalize would have torn down, or -1 if they were not counted.
+static Py_ssize_t flush_io_objects(void)
+{
+	PyObject *io, *base = 0, *gc = 0, *objects = 0, *o, *res;
+	Py_ssize_t i, n = -1;
+
+	io = PyDict_GetItemString(PyImport_GetModuleDict(), "_io");
+	if (!io && !ccf_report_enabled()) {
+		return -1;
+	}
+	if (io) {
+		base = PyObject_GetAttrString(io, "_IOBase");
+	}
+	gc = PyImport_ImportModule("gc");
+	if (gc) {
+		objects = PyObject_CallMethod(gc, "get_objects", "");
+	}
+	if (objects && PyList_Check(objects)) {
+		n = PyList_GET_SIZE(objects);
+		for (i = 0; base && PyType_Check(base) && i < n; i++) {
+			o = PyList_GET_ITEM(objects, i);
+			if (!PyObject_TypeCheck(o, (PyTypeObject *)base)) {
+				continue;
+			}
+			// like their __del__, ignore errors, e.g. of closed files
+			res = PyObject_CallMethod(o, "flush", "");
+			Py_XDECREF(res);
+			PyErr_Clear();
+		}
+	}
+	Py_XDECREF(objects);
+	Py_XDECREF(gc);
+	Py_XDECREF(base);
+	PyErr_Clear();
+	return n;
+}
+
+static void fast_exit(int status)
+{
+	Py_ssize_t objects;
+
+	PyObject *threading, *exitfunc, *res;
+
+	ccf_phase_begin(CCF_PHASE_FAST_EXIT);
+	threading = PyDict_GetItemString(PyImport_GetModuleDict(), "threading");
+	if (threading) {
+		res = PyObject_CallMethod(threading, "_shutdown", "");
+		if (res) {
+			Py_DECREF(res);
+		} else {
+			PyErr_WriteUnraisable(threading);
+		}
+	}
+
+	// atexit handlers
+	exitfunc = PySys_GetObject("exitfunc");
+	if (exitfunc) {
+		Py_INCREF(exitfunc);
+		PySys_SetObject("exitfunc", 0);
+		res = PyEval_CallObject(exitfunc, 0);
+		Py_DECREF(exitfunc);
+		if (res) {
+			Py_DECREF(res);
+		} else if (PyErr_ExceptionMatches(PyExc_SystemExit)) {
+			status = system_exit_status();
+		} else {
+			PySys_WriteStderr("Error in sys.exitfunc:\n");
+			PyErr_Print();
+		}
+	}
+
+	if (Py_FlushLine() != 0) {
+		PyErr_Clear();
+	}
+	objects = flush_io_objects();
+	flush_file("stdout");
+	flush_file("stderr");
+	// file objects write through stdio
+	fflush(0);
+	ccf_phase_end(CCF_PHASE_FAST_EXIT);
+	if (objects >= 0) {
+		ccf_report_skipped(objects);
+	}
+	ccf_run_atexit();
+	_exit(status);
+}
+
+// run __main__ for each job of the batch, in a copy of locals. Raises
+// SystemExit(1) if any of them failed.
+static PyObject *run_batch(PyObject *locals)
+{
+	PyObject *job_locals, *res, *type, *value, *tb;
+	int failed = 0, status, more;
+
+	while ((more = ccf_batch_begin()) == 1) {
+		job_locals = PyDict_Copy(locals);
+		res = job_locals ? run_main(job_locals) : 0;
+		Py_XDECREF(job_locals);
+		if (res) {
+			Py_DECREF(res);
+			status = 0;
+		} else if (PyErr_ExceptionMatches(PyExc_SystemExit)) {
+			status = system_exit_status();
+		} else if (PyErr_ExceptionMatches(PyExc_KeyboardInterrupt)) {
+			// ends the batch
+			PyErr_Fetch(&type, &value, &tb);
+			ccf_batch_end(1);
+			PyErr_Restore(type, value, tb);
+			return 0;
+		} else {
+			fflush(stdout);
+			PyErr_Print();
+			status = 1;
+		}
+		ccf_batch_end(status);
+		failed |= status != 0;
+	}
+	if (more < 0) {
+		return 0;
+	}
+	if (failed) {
+		res = PyInt_FromLong(1);
+		PyErr_SetObject(PyExc_SystemExit, res);
+		Py_XDECREF(res);
+		return 0;
+	}
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+#endif
+
 static int run_script(void)
 {
 	PyObject *locals;
@@ -76,26 +337,209 @@ static int run_script(void)
 
 	PyDict_SetItemString(locals, "__builtins__", PyEval_GetBuiltins());
 
+	ccf_phase_begin(CCF_PHASE_BOOTSTRAP);
+#ifndef WIN32
+	ccf_gc_pause();
+#endif
 	tmp = PyRun_String(
 		"import sys\n"
 		"del sys.path[2:]\n"
 		"sys.frozen=1\n"
+#ifdef WIN32
 		"import zipimport\n"
-		"importer = zipimport.zipimporter(sys.path[0])\n"
-		"exec importer.get_code('__main__')\n",
+		"importer = zipimport.zipimporter(sys.path[0])\n",
+#else
+		"import _ccfreeze\n"
+		"importer = _ccfreeze.install(sys.path[0])\n",
+#endif
 		Py_file_input, locals, 0
 		);
+	ccf_phase_end(CCF_PHASE_BOOTSTRAP);
+
+#ifndef WIN32
+	// a zygote continues here in every child it forks
+	if (tmp && ccf_zygote_serve() != 0) {
+		Py_DECREF(tmp);
+		tmp = 0;
+	}
+#endif
+	if (tmp) {
+		Py_DECREF(tmp);
+#ifndef WIN32
+		if (ccf_batch_enabled()) {
+			tmp = run_batch(locals);
+		} else
+#endif
+		tmp = run_main(locals);
+	}
 
+#ifndef WIN32
+	// a fast exit leaves __main__'s objects alone too
+	if (!exit_fast())
+#endif
 	Py_DECREF(locals);
 
 	if (!tmp) {
+#ifndef WIN32
+		if (exit_fast() && PyErr_ExceptionMatches(PyExc_SystemExit)) {
+			fast_exit(system_exit_status());
+		}
+#endif
+		// for SystemExit, PyErr_Print finalizes and exits
+		if (PyErr_ExceptionMatches(PyExc_SystemExit)) {
+			ccf_phase_begin(CCF_PHASE_FINALIZE);
+		}
+		// output before the traceback
+		fflush(stdout);
 		PyErr_Print();
 	}
 
+#ifndef WIN32
+	if (exit_fast()) {
+		fast_exit(tmp ? 0 : 1);
+	}
+#endif
+	ccf_phase_begin(CCF_PHASE_FINALIZE);
 	Py_Finalize();
 	return tmp ? 0 : 1;
 }
 
+#ifndef WIN32
+static int sigterm_pipe[2] = {-1, -1};
+
+// SIGTERM's default action would lose buffered output. The handler only
+// wakes this thread, which flushes and then dies from SIGTERM, whatever
+// the main thread is blocked in. A second SIGTERM kills right away.
+static void *sigterm_thread(void *unused)
+{
+	sigset_t set;
+	int tries;
+	char c;
+
+	// with all signals blocked, nothing interrupts the read
+	if (read(sigterm_pipe[0], &c, 1) != 1) {
+		return 0;
+	}
+	// not fflush(0), it waits for the lock of a stdin blocked in fread. A
+	// main thread stuck writing to a full pipe holds the lock of stdout
+	// too: give up on the buffered output after a while then.
+	for (tries = 0; tries < 20; tries++) {
+		if (ftrylockfile(stdout) == 0) {
+			fflush_unlocked(stdout);
+			funlockfile(stdout);
+			break;
+		}
+		usleep(5000);
+	}
+	signal(SIGTERM, SIG_DFL);
+	sigemptyset(&set);
+	sigaddset(&set, SIGTERM);
+	pthread_sigmask(SIG_UNBLOCK, &set, 0);
+	raise(SIGTERM);
+	return 0;
+}
+
+static void on_sigterm(int sig)
+{
+	int err = errno;
+
+	signal(SIGTERM, SIG_DFL);
+	if (write(sigterm_pipe[1], "", 1) < 0) {
+		raise(SIGTERM);
+	}
+	errno = err;
+}
+
+static int start_sigterm_thread(void)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+	sigset_t set, old;
+	int err;
+
+	if (pipe(sigterm_pipe) != 0) {
+		return -1;
+	}
+	fcntl(sigterm_pipe[0], F_SETFD, FD_CLOEXEC);
+	fcntl(sigterm_pipe[1], F_SETFD, FD_CLOEXEC);
+	// the program's signals go to its threads, not this one
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	err = pthread_create(&thread, &attr, sigterm_thread, 0);
+	pthread_attr_destroy(&attr);
+	pthread_sigmask(SIG_SETMASK, &old, 0);
+	if (err != 0) {
+		close(sigterm_pipe[0]);
+		close(sigterm_pipe[1]);
+		sigterm_pipe[0] = sigterm_pipe[1] = -1;
+		return -1;
+	}
+	return 0;
+}
+
+// the thread does not survive fork(), and the parent's must not read the
+// child's wakeups
+static void sigterm_after_fork(void)
+{
+	if (sigterm_pipe[0] >= 0) {
+		close(sigterm_pipe[0]);
+		close(sigterm_pipe[1]);
+		sigterm_pipe[0] = sigterm_pipe[1] = -1;
+		if (start_sigterm_thread() != 0) {
+			signal(SIGTERM, SIG_DFL);
+		}
+	}
+}
+
+// the stdio option picks the buffering of stdin and stdout: unbuffered
+// (the default), line or full, stdio_buffer_size sets the buffer size.
+// stderr stays unbuffered.
+static void setup_stdio(void)
+{
+	const char *mode = ccf_option("stdio");
+	long size = ccf_option_long("stdio_buffer_size", 65536);
+	static char *inbuf, *outbuf;
+	struct sigaction sa;
+	int type;
+
+	if (mode && strcmp(mode, "line") == 0) {
+		type = _IOLBF;
+	} else if (mode && strcmp(mode, "full") == 0) {
+		type = _IOFBF;
+	} else {
+		type = _IONBF;
+	}
+	if (size <= 0) {
+		size = 65536;
+	}
+	// glibc ignores the size unless it is given the buffer as well
+	if (type != _IONBF && !inbuf) {
+		inbuf = malloc(size);
+		outbuf = malloc(size);
+	}
+	if (type != _IONBF && inbuf && outbuf) {
+		setvbuf(stdin, inbuf, _IOFBF, size);
+		setvbuf(stdout, outbuf, type, size);
+	} else {
+		setvbuf(stdin, (char *)NULL, type == _IONBF ? _IONBF : _IOFBF, size);
+		setvbuf(stdout, (char *)NULL, type, size);
+	}
+	setbuf(stderr, (char *)NULL);
+
+	if (type != _IONBF && sigaction(SIGTERM, 0, &sa) == 0 && sa.sa_handler == SIG_DFL
+	    && start_sigterm_thread() == 0) {
+		pthread_atfork(0, 0, sigterm_after_fork);
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = on_sigterm;
+		sa.sa_flags = SA_RESTART;
+		sigemptyset(&sa.sa_mask);
+		sigaction(SIGTERM, &sa, 0);
+	}
+}
+#endif
+
 static void set_program_path(char *argv0)
 {
 #ifndef WIN32
@@ -111,6 +555,7 @@ static void set_program_path(char *argv0)
 	} else {
 		progpath[count] = 0;
 		Py_SetProgramName(progpath);
+		ccf_program_path_resolved = 1;
 	}
 #else
 	Py_SetProgramName(argv0);
@@ -119,10 +564,20 @@ static void set_program_path(char *argv0)
 
 static int loader_main(int argc, char **argv)
 {
+#ifndef WIN32
+	// returns unless a zygote ran the program
+	ccf_zygote_client(argc, argv);
+	ccf_report_init();
+	ccf_trace_init();
+	ccf_record_init();
+#endif
+
+#ifdef WIN32
 	// make stdin, stdout and stderr unbuffered
 	setbuf(stdin, (char *)NULL);
 	setbuf(stdout, (char *)NULL);
 	setbuf(stderr, (char *)NULL);
+#endif
 
 	// initialize Python
 	Py_NoSiteFlag = 1;
@@ -134,14 +589,41 @@ static int loader_main(int argc, char **argv)
 #endif
 	Py_SetPythonHome("");
 
+	ccf_phase_begin(CCF_PHASE_PROGRAM_PATH);
 	set_program_path(argv[0]);
+	ccf_phase_end(CCF_PHASE_PROGRAM_PATH);
+#ifndef WIN32
+	// maps the archive, which holds the options
+	ccf_get_syspath();
+	ccf_archive_readahead(ccf_loader_archive);
+	ccf_options_load(ccf_loader_archive);
+	ccf_alloc_setup();
+	ccf_shm_cache_open(ccf_loader_archive);
+	ccf_prefetch_start(ccf_loader_archive);
+	setup_stdio();
+	PyImport_AppendInittab("_ccfreeze", init_ccfreeze);
+#endif
+#ifdef CCF_STATIC_EXTENSIONS
+	PyImport_ExtendInittab(ccf_static_extensions);
+#endif
+#ifdef CCF_FROZEN_MODULES
+	// found before the archive, without reading it
+	PyImport_FrozenModules = ccf_frozen_modules;
+#endif
+	Py_AtExit(finalized);
+	ccf_phase_begin(CCF_PHASE_INITIALIZE);
 	Py_Initialize();
-	PySys_SetArgv(argc, argv);
+	ccf_phase_end(CCF_PHASE_INITIALIZE);
+	// PySys_SetArgv would resolve argv[0] one readlink() per directory for
+	// a sys.path[0] that PySys_SetPath replaces
+	PySys_SetArgvEx(argc, argv, 0);
+	ccf_phase_begin(CCF_PHASE_SET_PATH);
 #ifdef WIN32
 	compute_syspath();
 	PySys_SetPath(syspath);
 #else
-	PySys_SetPath(Py_GetPath());
+	PySys_SetPath(ccf_get_syspath());
 #endif
+	ccf_phase_end(CCF_PHASE_SET_PATH);
 	return run_script();
 }
@@ -0,0 +1,89 @@
+// options chosen when the program is frozen, see options.h
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "options.h"
+
+#define MAX_OPTIONS 64
+
+static struct {
+	char *buf;
+	int count;
+	const char *names[MAX_OPTIONS];
+	const char *values[MAX_OPTIONS];
+} options;
+
+static char *strip(char *s, char *end)
+{
+	while (s < end && (*s == ' ' || *s == '\t')) {
+		s++;
+	}
+	while (end > s && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r')) {
+		end--;
+	}
+	*end = 0;
+	return s;
+}
+
+void ccf_options_load(struct ccf_archive *ar)
+{
+	const unsigned char *data;
+	struct ccf_entry e;
+	void *owned;
+	char *line, *next, *eq;
+
+	if (!ar || !ccf_archive_find_meta(ar, CCF_OPTIONS_NAME, &e)
+	    || ccf_entry_read(ar, &e, &data, &owned) != 0) {
+		return;
+	}
+	options.buf = malloc(e.usize + 1);
+	if (options.buf) {
+		memcpy(options.buf, data, e.usize);
+		options.buf[e.usize] = 0;
+	}
+	free(owned);
+	if (!options.buf) {
+		return;
+	}
+
+	for (line = options.buf; line && options.count < MAX_OPTIONS; line = next) {
+		next = strchr(line, '\n');
+		if (next) {
+			*next++ = 0;
+		}
+		eq = strchr(line, '=');
+		if (!eq || *line == '#') {
+			continue;
+		}
+		options.names[options.count] = strip(line, eq);
+		options.values[options.count] = strip(eq + 1, eq + 1 + strlen(eq + 1));
+		options.count++;
+	}
+}
+
+const char *ccf_option(const char *name)
+{
+	int i;
+
+	// the last one wins
+	for (i = options.count - 1; i >= 0; i--) {
+		if (strcmp(options.names[i], name) == 0) {
+			return options.values[i];
+		}
+	}
+	return 0;
+}
+
+long ccf_option_long(const char *name, long def)
+{
+	const char *value = ccf_option(name);
+	char *end;
+	long n;
+
+	if (!value || !*value) {
+		return def;
+	}
+	n = strtol(value, &end, 0);
+	return *end ? def : n;
+}
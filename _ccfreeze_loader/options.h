@@ -0,0 +1,22 @@
+// options chosen when the program is frozen
+//
+// They are stored as "name=value" lines in the archive member
+// CCF_OPTIONS_NAME (see pack.py options) and read before Py_Initialize.
+
+#ifndef CCFREEZE_OPTIONS_H
+#define CCFREEZE_OPTIONS_H
+
+#include "archive.h"
+
+#define CCF_OPTIONS_NAME ".ccfreeze/options"
+
+// read the options of ar, which may be 0
+void ccf_options_load(struct ccf_archive *ar);
+
+// value of an option, 0 if it is not set
+const char *ccf_option(const char *name);
+
+// value of a numeric option, def if it is not set or not a number
+long ccf_option_long(const char *name, long def);
+
+#endif
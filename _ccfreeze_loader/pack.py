@@ -0,0 +1,763 @@
+"""post-process the archive a ccfreeze loader runs from
+
+usage: python -m _ccfreeze_loader.pack <command> ...
+"""
+
+import os
+import sys
+import struct
+import shutil
+import zlib
+import zipfile
+
+TRAILER = struct.Struct("<QQII8s")
+TRAILER_VERSION = 1
+TRAILER_MAGIC = b"CCFREEZE"
+
+EOCD = struct.Struct("<4sHHHHIIH")
+LOCAL_HEADER = struct.Struct("<4sHHHHHIIIHH")
+CENTRAL_HEADER = struct.Struct("<4sHHHHHHIIIHHHHHII")
+
+# compression methods the loader reads besides stored and deflated
+ZSTD = 93
+LZ4 = 0x4c34  # not assigned by the zip specification
+DICT_SIZE = 112640  # what zstd --train makes by default
+
+META_PREFIX = ".ccfreeze/"
+INDEX_NAME = META_PREFIX + "index"
+OPTIONS_NAME = META_PREFIX + "options"
+READAHEAD_NAME = META_PREFIX + "readahead"
+MANIFEST_NAME = META_PREFIX + "manifest"
+DICT_NAME = META_PREFIX + "dict"
+INDEX_MAGIC = b"CCFINDEX"
+INDEX_VERSION = 4
+INDEX_HEADER = struct.Struct("<8sIIII8x")
+INDEX_RECORD = struct.Struct("<IHHIHHIIII")
+INDEX_BYTECODE = 0x1
+INDEX_PACKAGE = 0x2
+INDEX_EXTENSION = 0x4
+
+PACK_MAGIC = b"CCFPACK\x01"
+PACK_VERSION = 1
+PACK_HEADER = struct.Struct("<8sIIIIII")
+PACK_ALIGN = 4096
+
+# the loader's search order for a module, best match first
+MODULE_SUFFIXES = [
+    ("/__init__.pyc", INDEX_PACKAGE | INDEX_BYTECODE),
+    ("/__init__.pyo", INDEX_PACKAGE | INDEX_BYTECODE),
+    ("/__init__.py", INDEX_PACKAGE),
+    (".pyc", INDEX_BYTECODE),
+    (".pyo", INDEX_BYTECODE),
+    (".py", 0),
+    (".so", INDEX_EXTENSION),
+]
+
+
+def find_eocd(data):
+    """return the offset of the zip end of central directory record"""
+    pos = data.rfind(b"PK\x05\x06", max(0, len(data) - EOCD.size - 0xffff))
+    if pos < 0:
+        raise ValueError("not a zip archive")
+    return pos
+
+
+def central_directory_crc(data):
+    """crc32 over the central directory and end record, as checked by the loader
+
+    for a pack file, the crc32 of its metadata
+    """
+    if data.startswith(PACK_MAGIC):
+        meta_size = PACK_HEADER.unpack_from(data)[6]
+        return zlib.crc32(data[:meta_size]) & 0xffffffff
+    pos = find_eocd(data)
+    cd_size = EOCD.unpack_from(data, pos)[5]
+    return zlib.crc32(data[pos - cd_size:]) & 0xffffffff
+
+
+def read_trailer(data):
+    """return (offset, size) of an appended archive or None"""
+    if len(data) < TRAILER.size:
+        return None
+    offset, size, checksum, version, magic = TRAILER.unpack_from(data, len(data) - TRAILER.size)
+    if magic != TRAILER_MAGIC or version != TRAILER_VERSION:
+        return None
+    return offset, size
+
+
+def name_hash(key, seed=0):
+    """the loader's string hash: FNV-1a and the murmur3 finalizer"""
+    h = (2166136261 ^ seed) & 0xffffffff
+    for c in bytearray(key):
+        h = ((h ^ c) * 16777619) & 0xffffffff
+    h ^= h >> 16
+    h = (h * 0x85ebca6b) & 0xffffffff
+    h ^= h >> 13
+    h = (h * 0xc2b2ae35) & 0xffffffff
+    h ^= h >> 16
+    return h
+
+
+def perfect_hash(keys):
+    """build a minimal perfect hash for keys (a list of byte strings)
+
+    returns (displacements, slots) where slots[i] is the index of the key
+    stored in record i
+    """
+    n = len(keys)
+    nbuckets = n // 3 + 1
+    while 1:
+        result = _perfect_hash(keys, nbuckets, 100 * n + 1000)
+        if result:
+            return result
+        # unlucky, smaller buckets are easier to place
+        nbuckets = nbuckets * 2
+
+
+def _perfect_hash(keys, nbuckets, max_disp):
+    n = len(keys)
+    buckets = [[] for _ in range(nbuckets)]
+    for i, k in enumerate(keys):
+        buckets[name_hash(k) % nbuckets].append(i)
+
+    disp = [0] * nbuckets
+    slots = [None] * n
+    for b in sorted(range(nbuckets), key=lambda b: -len(buckets[b])):
+        items = buckets[b]
+        if not items:
+            break
+        d = 1
+        while 1:
+            pos = [name_hash(keys[i], d) % n for i in items]
+            if len(set(pos)) == len(pos) and all(slots[p] is None for p in pos):
+                break
+            d += 1
+            if d > max_disp:
+                return None
+        disp[b] = d
+        for i, p in zip(items, pos):
+            slots[p] = i
+    return disp, slots
+
+
+def index_key(name):
+    """return (key, flags, rank) for an archive member or None"""
+    if name.startswith(META_PREFIX):
+        return name, 0, 0
+    return module_name(name)
+
+
+def module_name(name):
+    """return (module name, flags, rank) for an archive member or None"""
+    for rank, (suffix, flags) in enumerate(MODULE_SUFFIXES):
+        if name.endswith(suffix):
+            mod = name[:-len(suffix)]
+            if not mod or mod.startswith(META_PREFIX):
+                return None
+            return mod.replace("/", "."), flags, rank
+    return None
+
+
+def _data_offset(f, info):
+    f.seek(info.header_offset)
+    h = LOCAL_HEADER.unpack(f.read(LOCAL_HEADER.size))
+    return info.header_offset + LOCAL_HEADER.size + h[9] + h[10]
+
+
+def _remove_members(archive, names):
+    """rewrite archive without the given members"""
+    tmp = archive + ".tmp"
+    with zipfile.ZipFile(archive) as src:
+        with zipfile.ZipFile(tmp, "w") as dst:
+            for info in src.infolist():
+                if info.filename not in names:
+                    dst.writestr(info, src.read(info))
+            if not src.comment.startswith(INDEX_MAGIC):
+                dst.comment = src.comment
+    os.rename(tmp, archive)
+
+
+def build_index(members, count):
+    """return a module index for members
+
+    members is a list of (name, compress_type, compress_size, file_size, crc,
+    data_offset) tuples, count the number of entries of the archive.
+    """
+    modules = {}
+    for m in members:
+        mod = index_key(m[0])
+        if mod is None:
+            continue
+        mod, flags, rank = mod
+        if mod in modules and modules[mod][0] <= rank:
+            continue
+        modules[mod] = (rank, flags, m)
+
+    keys = sorted(modules)
+    if not keys:
+        return None
+    bkeys = [k.encode("utf-8") for k in keys]
+    disp, slots = perfect_hash(bkeys)
+
+    at = INDEX_HEADER.size + 4 * len(disp) + INDEX_RECORD.size * len(keys)
+    strings = []
+    records = []
+    for i in slots:
+        rank, flags, (name, method, csize, usize, crc, data_offset) = modules[keys[i]]
+        name = name.encode("utf-8")
+        key_at = at
+        name_at = at + len(bkeys[i])
+        at = name_at + len(name)
+        strings.append(bkeys[i])
+        strings.append(name)
+        records.append(INDEX_RECORD.pack(key_at, len(bkeys[i]), flags, name_at, len(name),
+                                         method, csize, usize, crc, data_offset))
+
+    return b"".join([INDEX_HEADER.pack(INDEX_MAGIC, INDEX_VERSION, len(keys), len(disp), count),
+                     struct.pack("<%dI" % len(disp), *disp)] + records + strings)
+
+
+def add_index(archive):
+    """store a perfect-hash module index in archive
+
+    must be the last step before appending the archive to a loader, adding
+    or removing members afterwards makes the loader ignore the index.
+    """
+    with zipfile.ZipFile(archive) as z:
+        names = z.namelist()
+    if INDEX_NAME in names:
+        _remove_members(archive, [INDEX_NAME])
+
+    members = []
+    with open(archive, "rb") as f:
+        with zipfile.ZipFile(f) as z:
+            for info in z.infolist():
+                if index_key(info.filename) is None:
+                    continue
+                members.append((info.filename, info.compress_type, info.compress_size,
+                                info.file_size, info.CRC & 0xffffffff, _data_offset(f, info)))
+            count = len(z.infolist()) + 1
+
+    index = build_index(members, count)
+    if index is None:
+        return
+
+    with zipfile.ZipFile(archive, "a") as z:
+        z.writestr(zipfile.ZipInfo(INDEX_NAME), index)
+        offset = z.getinfo(INDEX_NAME).header_offset
+        z.comment = INDEX_MAGIC + struct.pack("<I", offset)
+
+
+def flatten(archive, output, align=PACK_ALIGN):
+    """convert the zip file archive into a pack file
+
+    every member is stored uncompressed at a multiple of align, which lets
+    the loader unmarshal code objects straight out of its mapping.
+    """
+    with zipfile.ZipFile(archive) as z:
+        infos = [i for i in z.infolist() if i.filename != INDEX_NAME]
+        contents = [z.read(i) for i in infos]
+    names = [i.filename.encode("utf-8") for i in infos]
+    count = len(infos)
+
+    def pad(n):
+        return -n % align
+
+    # the size of the index does not depend on the offsets it stores
+    table = PACK_HEADER.size
+    strings = table + INDEX_RECORD.size * count
+    index_at = strings + sum(len(n) for n in names)
+    index_size = len(build_index([(i.filename, 0, 0, 0, 0, 0) for i in infos], count) or b"")
+    meta_size = index_at + index_size
+
+    offsets = []
+    at = meta_size + pad(meta_size)
+    for data in contents:
+        offsets.append(at)
+        at += len(data) + pad(len(data))
+
+    members = [(i.filename, zipfile.ZIP_STORED, len(data), len(data),
+                zlib.crc32(data) & 0xffffffff, offset)
+               for i, data, offset in zip(infos, contents, offsets)]
+    index = build_index(members, count) or b""
+    assert len(index) == index_size
+
+    records = []
+    name_at = strings
+    for name, (n, method, csize, usize, crc, data_offset) in zip(names, members):
+        records.append(INDEX_RECORD.pack(0, 0, 0, name_at, len(name),
+                                         method, csize, usize, crc, data_offset))
+        name_at += len(name)
+
+    header = PACK_HEADER.pack(PACK_MAGIC, PACK_VERSION, count, table,
+                              index_at if index else 0, index_size, meta_size)
+    tmp = output + ".tmp"
+    with open(tmp, "wb") as f:
+        f.write(header)
+        f.write(b"".join(records))
+        f.write(b"".join(names))
+        f.write(index)
+        for data in contents:
+            f.write(b"\0" * pad(f.tell()))
+            f.write(data)
+    os.rename(tmp, output)
+
+
+def _load_library(name, method):
+    import ctypes
+    import ctypes.util
+
+    path = ctypes.util.find_library(name)
+    if not path:
+        raise RuntimeError("lib%s is needed to compress with %s" % (name, method))
+    return ctypes.CDLL(path)
+
+
+def train_dictionary(samples, size=DICT_SIZE):
+    """train a zstd dictionary of at most size bytes on samples, a list of
+    byte strings. Returns None if there are too few samples.
+    """
+    import ctypes
+
+    zstd = _load_library("zstd", "a dictionary")
+    zstd.ZDICT_trainFromBuffer.restype = ctypes.c_size_t
+    zstd.ZDICT_trainFromBuffer.argtypes = [ctypes.c_char_p, ctypes.c_size_t, ctypes.c_char_p,
+                                           ctypes.POINTER(ctypes.c_size_t), ctypes.c_uint]
+    zstd.ZDICT_isError.argtypes = [ctypes.c_size_t]
+    samples = [x for x in samples if x]
+    if not samples:
+        return None
+    buf = ctypes.create_string_buffer(size)
+    sizes = (ctypes.c_size_t * len(samples))(*[len(x) for x in samples])
+    n = zstd.ZDICT_trainFromBuffer(buf, size, b"".join(samples), sizes, len(samples))
+    if zstd.ZDICT_isError(n):
+        return None
+    return buf.raw[:n]
+
+
+class ZstdCodec(object):
+    """zstd through ctypes, decompression is for benchmarks"""
+
+    method = ZSTD
+    default_level = 19
+
+    def __init__(self, level=None, dictionary=None):
+        import ctypes
+
+        c = ctypes
+        z = self.lib = _load_library("zstd", "zstd")
+        for name, restype, argtypes in [
+                ("ZSTD_compressBound", c.c_size_t, [c.c_size_t]),
+                ("ZSTD_isError", c.c_uint, [c.c_size_t]),
+                ("ZSTD_getErrorName", c.c_char_p, [c.c_size_t]),
+                ("ZSTD_createCCtx", c.c_void_p, []),
+                ("ZSTD_createDCtx", c.c_void_p, []),
+                ("ZSTD_createCDict", c.c_void_p, [c.c_char_p, c.c_size_t, c.c_int]),
+                ("ZSTD_createDDict", c.c_void_p, [c.c_char_p, c.c_size_t]),
+                ("ZSTD_compressCCtx", c.c_size_t,
+                 [c.c_void_p, c.c_char_p, c.c_size_t, c.c_char_p, c.c_size_t, c.c_int]),
+                ("ZSTD_compress_usingCDict", c.c_size_t,
+                 [c.c_void_p, c.c_char_p, c.c_size_t, c.c_char_p, c.c_size_t, c.c_void_p]),
+                ("ZSTD_decompressDCtx", c.c_size_t,
+                 [c.c_void_p, c.c_char_p, c.c_size_t, c.c_char_p, c.c_size_t]),
+                ("ZSTD_decompress_usingDDict", c.c_size_t,
+                 [c.c_void_p, c.c_char_p, c.c_size_t, c.c_char_p, c.c_size_t, c.c_void_p])]:
+            f = getattr(z, name)
+            f.restype = restype
+            f.argtypes = argtypes
+        self.level = level or self.default_level
+        self.cctx = z.ZSTD_createCCtx()
+        self.dctx = z.ZSTD_createDCtx()
+        self.cdict = self.ddict = None
+        if dictionary:
+            self.cdict = z.ZSTD_createCDict(dictionary, len(dictionary), self.level)
+            self.ddict = z.ZSTD_createDDict(dictionary, len(dictionary))
+
+    def _check(self, n):
+        if self.lib.ZSTD_isError(n):
+            raise ValueError("zstd: %s" % (self.lib.ZSTD_getErrorName(n),))
+        return n
+
+    def compress(self, data):
+        import ctypes
+
+        cap = self.lib.ZSTD_compressBound(len(data))
+        buf = ctypes.create_string_buffer(cap)
+        if self.cdict:
+            n = self.lib.ZSTD_compress_usingCDict(self.cctx, buf, cap, data, len(data), self.cdict)
+        else:
+            n = self.lib.ZSTD_compressCCtx(self.cctx, buf, cap, data, len(data), self.level)
+        return buf.raw[:self._check(n)]
+
+    def decompress_into(self, buf, data):
+        if self.ddict:
+            n = self.lib.ZSTD_decompress_usingDDict(self.dctx, buf, len(buf), data, len(data),
+                                                    self.ddict)
+        else:
+            n = self.lib.ZSTD_decompressDCtx(self.dctx, buf, len(buf), data, len(data))
+        return self._check(n)
+
+
+class LZ4Codec(object):
+    """LZ4 (the HC compressor) through ctypes, decompression is for benchmarks
+
+    a dictionary is used like the loader does, only its last 64 KiB.
+    """
+
+    method = LZ4
+    default_level = 12
+
+    def __init__(self, level=None, dictionary=None):
+        import ctypes
+
+        c = ctypes
+        z = self.lib = _load_library("lz4", "LZ4")
+        for name, restype, argtypes in [
+                ("LZ4_compressBound", c.c_int, [c.c_int]),
+                ("LZ4_createStreamHC", c.c_void_p, []),
+                ("LZ4_resetStreamHC_fast", None, [c.c_void_p, c.c_int]),
+                ("LZ4_loadDictHC", c.c_int, [c.c_void_p, c.c_char_p, c.c_int]),
+                ("LZ4_compress_HC", c.c_int, [c.c_char_p, c.c_char_p, c.c_int, c.c_int, c.c_int]),
+                ("LZ4_compress_HC_continue", c.c_int,
+                 [c.c_void_p, c.c_char_p, c.c_char_p, c.c_int, c.c_int]),
+                ("LZ4_decompress_safe_usingDict", c.c_int,
+                 [c.c_char_p, c.c_char_p, c.c_int, c.c_int, c.c_char_p, c.c_int])]:
+            f = getattr(z, name)
+            f.restype = restype
+            f.argtypes = argtypes
+        self.level = level or self.default_level
+        # the stream refers to it, keep it alive
+        self.dictionary = dictionary[-65536:] if dictionary else b""
+        self.stream = z.LZ4_createStreamHC() if self.dictionary else None
+
+    def compress(self, data):
+        import ctypes
+
+        cap = self.lib.LZ4_compressBound(len(data))
+        buf = ctypes.create_string_buffer(cap)
+        if self.stream:
+            self.lib.LZ4_resetStreamHC_fast(self.stream, self.level)
+            self.lib.LZ4_loadDictHC(self.stream, self.dictionary, len(self.dictionary))
+            n = self.lib.LZ4_compress_HC_continue(self.stream, data, buf, len(data), cap)
+        else:
+            n = self.lib.LZ4_compress_HC(data, buf, len(data), cap, self.level)
+        if n <= 0 and data:
+            raise ValueError("LZ4 compression failed")
+        return buf.raw[:n]
+
+    def decompress_into(self, buf, data):
+        n = self.lib.LZ4_decompress_safe_usingDict(data, buf, len(data), len(buf),
+                                                   self.dictionary, len(self.dictionary))
+        if n < 0:
+            raise ValueError("LZ4: corrupt data")
+        return n
+
+
+CODECS = {"zstd": ZstdCodec, "lz4": LZ4Codec}
+
+
+def _dos_time(date_time):
+    y, mo, d, h, mi, s = date_time[:6]
+    return (h << 11) | (mi << 5) | (s // 2), ((y - 1980) << 9) | (mo << 5) | d
+
+
+def _write_zip(path, members, comment):
+    """write a zip file, members are (ZipInfo, method, payload, crc) tuples"""
+    central = []
+    with open(path, "wb") as f:
+        for info, method, payload, crc in members:
+            name = info.filename
+            if not isinstance(name, bytes):
+                name = name.encode("utf-8")
+            flags = info.flag_bits & 0x800
+            # zstd needs 6.3 by the specification
+            version = 63 if method == ZSTD else 20
+            dostime, dosdate = _dos_time(info.date_time)
+            offset = f.tell()
+            if offset > 0xffffffff or len(payload) > 0xffffffff:
+                raise ValueError("%s: too large, zip64 is not supported" % (path,))
+            f.write(LOCAL_HEADER.pack(b"PK\x03\x04", version, flags, method, dostime, dosdate,
+                                      crc, len(payload), info.file_size, len(name), 0))
+            f.write(name)
+            f.write(payload)
+            central.append(CENTRAL_HEADER.pack(b"PK\x01\x02", version, version, flags, method,
+                                               dostime, dosdate, crc, len(payload),
+                                               info.file_size, len(name), 0, 0, 0, 0,
+                                               info.external_attr, offset) + name)
+        cd = b"".join(central)
+        cd_offset = f.tell()
+        f.write(cd)
+        f.write(EOCD.pack(b"PK\x05\x06", 0, 0, len(members), len(members), len(cd), cd_offset,
+                          len(comment)))
+        f.write(comment)
+
+
+def compress(archive, method="zstd", level=None, dict_size=DICT_SIZE, output=None):
+    """rewrite the zip file archive with its members compressed with zstd or LZ4
+
+    a dictionary of at most dict_size bytes (0 for none) is trained on the
+    members and stored as DICT_NAME, which shrinks small .pyc files much
+    more than compressing each on its own; it is left out if the archive
+    is not smaller with it. Members that do not shrink are stored, the
+    members below META_PREFIX are left as they are, and the option
+    compression=method tells the loader what it needs. Needs
+    libzstd (and liblz4 for LZ4), the loader must be built with zstd.h
+    (lz4.h) found.
+
+    zipfile and zipimport can't read what this writes: run it after
+    reorder and options, and before index and append. An index is rebuilt.
+    Returns (number of members compressed, size of the dictionary).
+    """
+    with open(archive, "rb") as f:
+        if f.read(len(PACK_MAGIC)) == PACK_MAGIC:
+            raise ValueError("%s is a pack file, its members stay uncompressed" % (archive,))
+    with zipfile.ZipFile(archive) as src:
+        indexed = src.comment.startswith(INDEX_MAGIC)
+        comment = b"" if indexed else src.comment
+        infos = [i for i in src.infolist() if i.filename not in (INDEX_NAME, DICT_NAME)]
+        contents = [src.read(i) for i in infos]
+
+    def wanted(info):
+        return not info.filename.startswith(META_PREFIX)
+
+    def pack(dictionary):
+        codec = CODECS[method](level, dictionary)
+        members = []
+        if dictionary:
+            info = zipfile.ZipInfo(DICT_NAME)
+            info.file_size = len(dictionary)
+            members.append((info, zipfile.ZIP_STORED, dictionary,
+                            zlib.crc32(dictionary) & 0xffffffff))
+        count = 0
+        for info, data in zip(infos, contents):
+            crc = zlib.crc32(data) & 0xffffffff
+            packed = codec.compress(data) if wanted(info) and data else data
+            if len(packed) < len(data):
+                members.append((info, codec.method, packed, crc))
+                count += 1
+            else:
+                members.append((info, zipfile.ZIP_STORED, data, crc))
+        return members, count
+
+    def size(members):
+        return sum(len(m[2]) for m in members)
+
+    # the loader refuses an archive that needs a method it was built without
+    # instead of failing on the first import
+    options = [o for i, d in zip(infos, contents) if i.filename == OPTIONS_NAME
+               for o in d.decode("utf-8").splitlines() if not o.startswith("compression=")]
+    options.append("compression=" + method)
+    data = "".join(o + "\n" for o in options).encode("utf-8")
+    names = [i.filename for i in infos]
+    if OPTIONS_NAME not in names:
+        infos.append(zipfile.ZipInfo(OPTIONS_NAME))
+        contents.append(b"")
+        names.append(OPTIONS_NAME)
+    k = names.index(OPTIONS_NAME)
+    contents[k] = data
+    infos[k].file_size = len(data)
+
+    dictionary = None
+    if dict_size:
+        dictionary = train_dictionary([d for i, d in zip(infos, contents) if wanted(i)],
+                                      dict_size)
+    members, count = pack(None)
+    if dictionary:
+        # a dictionary only pays for itself with enough members sharing it
+        with_dict = pack(dictionary)
+        if size(with_dict[0]) < size(members):
+            members, count = with_dict
+        else:
+            dictionary = None
+
+    tmp = (output or archive) + ".tmp"
+    _write_zip(tmp, members, comment)
+    if indexed:
+        add_index(tmp)
+    os.rename(tmp, output or archive)
+    return count, len(dictionary or b"")
+
+
+def read_record(path):
+    """return the member names of a CCFREEZE_RECORD_ORDER record, first read first"""
+    names = []
+    seen = set()
+    with open(path, "rb") as f:
+        for line in f:
+            name = line.rstrip(b"\r\n").decode("utf-8")
+            if name and name not in seen:
+                seen.add(name)
+                names.append(name)
+    return names
+
+
+def reorder(archive, record, output):
+    """rewrite the zip file archive with the members listed in record first
+
+    record is a list of member names in the order a program read them. They
+    are followed by the READAHEAD_NAME marker, up to which the loader reads
+    the archive ahead at startup, and by the members the program did not
+    read, in their old order. The modules in record are stored in that
+    order as MANIFEST_NAME, which the loader prefetches from if the archive
+    has an index. An index is rebuilt.
+    """
+    special = (INDEX_NAME, READAHEAD_NAME, MANIFEST_NAME)
+    with open(archive, "rb") as f:
+        if f.read(len(PACK_MAGIC)) == PACK_MAGIC:
+            raise ValueError("%s is a pack file, reorder the zip file it was flattened from"
+                             % (archive,))
+    with zipfile.ZipFile(archive) as src:
+        indexed = src.comment.startswith(INDEX_MAGIC)
+        infos = dict((i.filename, i) for i in src.infolist())
+        hot = [infos[n] for n in record if n in infos and n not in special]
+        hot_names = set(i.filename for i in hot)
+        cold = [i for i in src.infolist()
+                if i.filename not in hot_names and i.filename not in special]
+        modules = []
+        for info in hot:
+            mod = module_name(info.filename)
+            if mod and mod[0] not in modules:
+                modules.append(mod[0])
+
+        tmp = output + ".tmp"
+        with zipfile.ZipFile(tmp, "w") as dst:
+            # read first, by the prefetcher
+            dst.writestr(zipfile.ZipInfo(MANIFEST_NAME), "".join(m + "\n" for m in modules))
+            for info in hot:
+                dst.writestr(info, src.read(info))
+            dst.writestr(zipfile.ZipInfo(READAHEAD_NAME), b"")
+            for info in cold:
+                dst.writestr(info, src.read(info))
+            if not indexed:
+                dst.comment = src.comment
+    if indexed:
+        add_index(tmp)
+    os.rename(tmp, output)
+    return len(hot)
+
+
+def set_options(archive, options):
+    """store the loader options (a list of "name=value" strings) in archive
+
+    replaces the options stored before. Run this before indexing or
+    flattening the archive.
+    """
+    for o in options:
+        if "=" not in o:
+            raise ValueError("option %r is not name=value" % (o,))
+    with zipfile.ZipFile(archive) as z:
+        names = z.namelist()
+    if OPTIONS_NAME in names:
+        _remove_members(archive, [OPTIONS_NAME])
+    with zipfile.ZipFile(archive, "a") as z:
+        z.writestr(zipfile.ZipInfo(OPTIONS_NAME), "".join(o + "\n" for o in options))
+
+
+def append_archive(loader, archive, output):
+    """write a single-file executable: loader + archive + trailer
+
+    an archive already appended to loader is replaced.
+    """
+    with open(loader, "rb") as f:
+        exe = f.read()
+    with open(archive, "rb") as f:
+        payload = f.read()
+
+    t = read_trailer(exe)
+    if t:
+        exe = exe[:t[0]]
+    if payload.startswith(PACK_MAGIC):
+        # keep the members of a pack file aligned in the executable
+        exe += b"\0" * (-len(exe) % PACK_ALIGN)
+
+    trailer = TRAILER.pack(len(exe), len(payload), central_directory_crc(payload),
+                           TRAILER_VERSION, TRAILER_MAGIC)
+    tmp = output + ".tmp"
+    with open(tmp, "wb") as f:
+        f.write(exe)
+        f.write(payload)
+        f.write(trailer)
+    shutil.copymode(loader, tmp)
+    os.rename(tmp, output)
+
+
+def extract_archive(exe, output):
+    """write the archive appended to exe to output"""
+    with open(exe, "rb") as f:
+        data = f.read()
+    t = read_trailer(data)
+    if not t:
+        raise ValueError("%s has no appended archive" % (exe,))
+    with open(output, "wb") as f:
+        f.write(data[t[0]:t[0] + t[1]])
+
+
+def main(argv=None):
+    import argparse
+
+    parser = argparse.ArgumentParser(prog="python -m _ccfreeze_loader.pack")
+    sub = parser.add_subparsers(dest="command")
+
+    p = sub.add_parser("append", help="append an archive to a loader executable")
+    p.add_argument("loader")
+    p.add_argument("archive")
+    p.add_argument("output")
+
+    p = sub.add_parser("index", help="store a perfect-hash module index in an archive")
+    p.add_argument("archive")
+
+    p = sub.add_parser("options", help="store loader options in an archive")
+    p.add_argument("archive")
+    p.add_argument("option", nargs="*", help="name=value, e.g. stdio=full")
+
+    p = sub.add_parser("flatten", help="convert a zip archive to an aligned, uncompressed pack file")
+    p.add_argument("archive")
+    p.add_argument("output")
+    p.add_argument("--align", type=int, default=PACK_ALIGN,
+                   help="alignment of member data (default: %(default)s)")
+
+    p = sub.add_parser("reorder",
+                       help="move the members read at startup to the front of a zip archive")
+    p.add_argument("archive")
+    p.add_argument("record", help="written by the loader with CCFREEZE_RECORD_ORDER set")
+    p.add_argument("-o", "--output", help="write here instead of replacing archive")
+
+    p = sub.add_parser("compress", help="compress the members of a zip archive with zstd or LZ4")
+    p.add_argument("archive")
+    p.add_argument("--method", choices=sorted(CODECS), default="zstd",
+                   help="(default: %(default)s)")
+    p.add_argument("--level", type=int,
+                   help="compression level (default: %d for zstd, %d for lz4)"
+                   % (ZstdCodec.default_level, LZ4Codec.default_level))
+    p.add_argument("--dict-size", type=int, default=DICT_SIZE,
+                   help="maximum size of the shared dictionary, 0 for none "
+                   "(default: %(default)s)")
+    p.add_argument("-o", "--output", help="write here instead of replacing archive")
+
+    p = sub.add_parser("extract", help="extract the archive appended to an executable")
+    p.add_argument("exe")
+    p.add_argument("output")
+
+    args = parser.parse_args(argv)
+    if args.command == "append":
+        append_archive(args.loader, args.archive, args.output)
+    elif args.command == "index":
+        add_index(args.archive)
+    elif args.command == "options":
+        set_options(args.archive, args.option)
+    elif args.command == "flatten":
+        flatten(args.archive, args.output, args.align)
+    elif args.command == "reorder":
+        reorder(args.archive, read_record(args.record), args.output or args.archive)
+    elif args.command == "compress":
+        compress(args.archive, args.method, args.level, args.dict_size, args.output)
+    elif args.command == "extract":
+        extract_archive(args.exe, args.output)
+    else:
+        parser.print_help()
+        return 2
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,311 @@
+// prefetching modules during startup, see prefetch.h
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "options.h"
+#include "prefetch.h"
+#include "record.h"
+#include "shmcache.h"
+#include "trace.h"
+
+#define MAX_THREADS 64
+
+enum { EMPTY, BUSY, READY, TAKEN };
+
+// a member, by its data offset
+struct slot {
+	size_t key;
+	void *buf;
+	size_t size;
+	int state;
+};
+
+static struct {
+	int started;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct ccf_archive *ar;
+	char *manifest;
+	char **names;
+	unsigned int count;
+	unsigned int next;	// the next name a worker takes
+	struct slot *slots;	// open addressing
+	unsigned int mask;
+	unsigned int used;
+	size_t bytes;		// inflated data in the cache
+	size_t limit;
+	int running;		// workers
+	int stopping;
+} prefetch = {
+	0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+};
+
+static struct slot *find_slot(size_t key, int insert)
+{
+	unsigned int h = (unsigned int)(key * 0x9e3779b1U) & prefetch.mask;
+
+	while (prefetch.slots[h].key) {
+		if (prefetch.slots[h].key == key) {
+			return &prefetch.slots[h];
+		}
+		h = (h + 1) & prefetch.mask;
+	}
+	// keep the table at most half full
+	if (!insert || prefetch.used > prefetch.mask / 2) {
+		return 0;
+	}
+	prefetch.used++;
+	prefetch.slots[h].key = key;
+	return &prefetch.slots[h];
+}
+
+static void fetch(const struct ccf_entry *e)
+{
+	const unsigned char *data;
+	struct slot *s;
+	void *owned;
+	int err;
+
+	if (e->method == CCF_STORED) {
+		// nothing to inflate, just get it off the disk
+		pthread_mutex_unlock(&prefetch.lock);
+		data = ccf_entry_raw(prefetch.ar, e);
+		if (data) {
+			ccf_trace_touch(data, e->csize);
+		}
+		pthread_mutex_lock(&prefetch.lock);
+		return;
+	}
+	// another process inflated it already
+	if (ccf_shm_cache_has(e)) {
+		return;
+	}
+	s = find_slot(e->data_offset, 1);
+	if (!s || s->state != EMPTY) {
+		return;
+	}
+	while (!prefetch.stopping && prefetch.bytes && prefetch.bytes + e->usize > prefetch.limit) {
+		pthread_cond_wait(&prefetch.cond, &prefetch.lock);
+	}
+	if (prefetch.stopping || s->state != EMPTY) {
+		return;
+	}
+	s->state = BUSY;
+	prefetch.bytes += e->usize;
+	pthread_mutex_unlock(&prefetch.lock);
+
+	err = ccf_entry_read(prefetch.ar, e, &data, &owned);
+
+	pthread_mutex_lock(&prefetch.lock);
+	if (err == 0 && owned) {
+		s->buf = owned;
+		s->size = e->usize;
+		s->state = READY;
+	} else {
+		// the importer reports the error
+		free(owned);
+		prefetch.bytes -= e->usize;
+		s->state = TAKEN;
+	}
+	pthread_cond_broadcast(&prefetch.cond);
+}
+
+static void *worker(void *unused)
+{
+	struct ccf_entry e;
+	const char *name;
+	int found;
+
+	pthread_mutex_lock(&prefetch.lock);
+	while (!prefetch.stopping && prefetch.next < prefetch.count) {
+		name = prefetch.names[prefetch.next++];
+		pthread_mutex_unlock(&prefetch.lock);
+		// the index is read-only, no need to hold the lock
+		found = ccf_archive_find_module(prefetch.ar, name, strlen(name), &e, 0);
+		pthread_mutex_lock(&prefetch.lock);
+		if (found == 1 && e.data_offset) {
+			fetch(&e);
+		}
+	}
+	prefetch.running--;
+	pthread_cond_broadcast(&prefetch.cond);
+	pthread_mutex_unlock(&prefetch.lock);
+	return 0;
+}
+
+static void forked(void)
+{
+	// the workers are gone, and so may be the lock. Leak the cache.
+	prefetch.started = 0;
+}
+
+static int read_manifest(struct ccf_archive *ar)
+{
+	const unsigned char *data;
+	struct ccf_entry e;
+	void *owned;
+	char *p, *end, *line;
+	unsigned int n, size;
+
+	if (!ccf_archive_find_meta(ar, CCF_MANIFEST_NAME, &e)
+	    || ccf_entry_read(ar, &e, &data, &owned) != 0) {
+		return -1;
+	}
+	prefetch.manifest = malloc(e.usize + 1);
+	if (prefetch.manifest) {
+		memcpy(prefetch.manifest, data, e.usize);
+		prefetch.manifest[e.usize] = 0;
+	}
+	free(owned);
+	if (!prefetch.manifest) {
+		return -1;
+	}
+
+	end = prefetch.manifest + e.usize;
+	n = 0;
+	for (p = prefetch.manifest; p < end; p++) {
+		n += *p == '\n';
+	}
+	prefetch.names = malloc((n + 1) * sizeof(char *));
+	size = 4;
+	while (size < 2 * (n + 1)) {
+		size *= 2;
+	}
+	prefetch.slots = calloc(size, sizeof(struct slot));
+	prefetch.mask = size - 1;
+	if (!prefetch.names || !prefetch.slots) {
+		return -1;
+	}
+	for (line = prefetch.manifest; line < end; line = p + 1) {
+		p = strchr(line, '\n');
+		if (!p) {
+			p = end;
+		}
+		*p = 0;
+		if (*line) {
+			prefetch.names[prefetch.count++] = line;
+		}
+	}
+	return 0;
+}
+
+static void release(void)
+{
+	unsigned int i;
+
+	if (prefetch.slots) {
+		for (i = 0; i <= prefetch.mask; i++) {
+			free(prefetch.slots[i].buf);
+		}
+	}
+	free(prefetch.slots);
+	free(prefetch.names);
+	free(prefetch.manifest);
+	prefetch.slots = 0;
+	prefetch.names = 0;
+	prefetch.manifest = 0;
+}
+
+void ccf_prefetch_start(struct ccf_archive *ar)
+{
+	static int registered = 0;
+	const char *record = getenv(CCF_RECORD_ENV);
+	long threads = ccf_option_long("prefetch_threads", 1);
+	pthread_attr_t attr;
+	pthread_t thread;
+
+	if (prefetch.started || !ar || !ar->index
+	    || !ccf_option_long("prefetch", sysconf(_SC_NPROCESSORS_ONLN) > 1)
+	    || (record && *record)) {
+		return;
+	}
+	if (read_manifest(ar) != 0 || !prefetch.count) {
+		release();
+		return;
+	}
+	if (!registered) {
+		pthread_atfork(0, 0, forked);
+		registered = 1;
+	}
+	prefetch.ar = ar;
+	prefetch.limit = ccf_option_long("prefetch_memory", 32 << 20);
+	prefetch.next = 0;
+	prefetch.used = 0;
+	prefetch.bytes = 0;
+	prefetch.stopping = 0;
+	if (threads < 1) {
+		threads = 1;
+	} else if (threads > MAX_THREADS) {
+		threads = MAX_THREADS;
+	}
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	pthread_mutex_lock(&prefetch.lock);
+	for (; threads > 0; threads--) {
+		if (pthread_create(&thread, &attr, worker, 0) == 0) {
+			prefetch.running++;
+		}
+	}
+	prefetch.started = prefetch.running > 0;
+	pthread_mutex_unlock(&prefetch.lock);
+	pthread_attr_destroy(&attr);
+	if (!prefetch.started) {
+		release();
+	}
+}
+
+void *ccf_prefetch_take(const struct ccf_entry *e)
+{
+	struct slot *s;
+	void *buf = 0;
+	int done;
+
+	if (!prefetch.started || !e->data_offset || e->method == CCF_STORED) {
+		return 0;
+	}
+	pthread_mutex_lock(&prefetch.lock);
+	// mark the member as taken so that no worker inflates it
+	s = find_slot(e->data_offset, 1);
+	while (s && s->state == BUSY) {
+		pthread_cond_wait(&prefetch.cond, &prefetch.lock);
+	}
+	if (s && s->state == READY) {
+		if (s->size == e->usize) {
+			buf = s->buf;
+		} else {
+			free(s->buf);
+		}
+		s->buf = 0;
+		prefetch.bytes -= s->size;
+		pthread_cond_broadcast(&prefetch.cond);
+	}
+	if (s) {
+		s->state = TAKEN;
+	}
+	done = !prefetch.running && !prefetch.bytes;
+	pthread_mutex_unlock(&prefetch.lock);
+	if (done) {
+		ccf_prefetch_stop();
+	}
+	return buf;
+}
+
+void ccf_prefetch_stop(void)
+{
+	if (!prefetch.started) {
+		return;
+	}
+	pthread_mutex_lock(&prefetch.lock);
+	prefetch.stopping = 1;
+	pthread_cond_broadcast(&prefetch.cond);
+	while (prefetch.running) {
+		pthread_cond_wait(&prefetch.cond, &prefetch.lock);
+	}
+	prefetch.started = 0;
+	pthread_mutex_unlock(&prefetch.lock);
+	release();
+}
@@ -0,0 +1,40 @@
+// prefetching modules during startup
+//
+// pack.py reorder stores the modules a recorded run imported, one dotted
+// name per line and in import order, as the archive member
+// CCF_MANIFEST_NAME. If the archive has a module index, worker threads go
+// through that list ahead of the importer: they fault in the members and
+// inflate the compressed ones into a cache, from which the importer takes
+// them instead of inflating them itself.
+//
+// Options:
+//	prefetch		0 turns it off, 1 on. It is on by default if
+//				there is more than one CPU.
+//	prefetch_threads	number of workers, 1 by default
+//	prefetch_memory		bytes of inflated data the cache holds at most,
+//				the workers wait for the importer beyond that
+//
+// Nothing is prefetched while recording an access order, see record.h.
+
+#ifndef CCFREEZE_PREFETCH_H
+#define CCFREEZE_PREFETCH_H
+
+#include "archive.h"
+
+#define CCF_MANIFEST_NAME ".ccfreeze/manifest"
+
+// start the workers if ar, which may be 0, has a manifest
+void ccf_prefetch_start(struct ccf_archive *ar);
+
+// the inflated data of e if a worker has it or is working on it, 0
+// otherwise. The caller must free() it.
+void *ccf_prefetch_take(const struct ccf_entry *e);
+
+// stop the workers and drop the cache, with what the importer did not
+// take. This happens by itself once the workers are done and the importer
+// took everything, once startup is done (see ccf_startup_done) and when
+// __main__'s top level returns. A forked child never prefetches, so stop
+// before forking processes that still import.
+void ccf_prefetch_stop(void);
+
+#endif
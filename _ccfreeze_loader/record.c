@@ -0,0 +1,58 @@
+// archive access record, see record.h
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "record.h"
+#include "report.h"
+
+#define BUFFER_SIZE (64 * 1024)
+
+static struct {
+	char *output;
+	char *buf;
+	size_t len;
+} record;
+
+static void flush(void)
+{
+	if (record.output && record.len) {
+		ccf_report_write(record.output, record.buf, record.len);
+	}
+	record.len = 0;
+}
+
+void ccf_record_init(void)
+{
+	static int registered = 0;
+	const char *output = getenv(CCF_RECORD_ENV);
+
+	free(record.output);
+	free(record.buf);
+	memset(&record, 0, sizeof(record));
+	if (!output || !*output) {
+		return;
+	}
+	record.buf = malloc(BUFFER_SIZE);
+	record.output = record.buf ? strdup(output) : 0;
+	if (!record.output) {
+		return;
+	}
+	if (!registered) {
+		ccf_atexit(flush);
+		registered = 1;
+	}
+}
+
+void ccf_record_entry(const struct ccf_entry *e)
+{
+	if (!record.output || e->name_len >= BUFFER_SIZE) {
+		return;
+	}
+	if (BUFFER_SIZE - record.len <= e->name_len) {
+		flush();
+	}
+	memcpy(record.buf + record.len, e->name, e->name_len);
+	record.len += e->name_len;
+	record.buf[record.len++] = '\n';
+}
@@ -0,0 +1,27 @@
+// archive access record
+//
+// With CCFREEZE_RECORD_ORDER set to a file name or to the number of an
+// open file descriptor, the loader writes the name of every archive member
+// the program imports, loads as an extension or reads as a resource, one
+// per line in that order. Reads by the prefetch workers and the loader's
+// own members below .ccfreeze/ are not listed, members read more than once
+// are listed every time. Names are buffered and written in blocks and
+// at exit.
+//
+// pack.py reorder takes such a record and moves the members a program
+// reads at startup to the front of its archive, see ccf_archive_readahead().
+
+#ifndef CCFREEZE_RECORD_H
+#define CCFREEZE_RECORD_H
+
+#include "archive.h"
+
+#define CCF_RECORD_ENV "CCFREEZE_RECORD_ORDER"
+
+// start recording if CCF_RECORD_ENV is set. Calling this again, e.g. in a
+// forked child, discards unwritten names.
+void ccf_record_init(void);
+
+void ccf_record_entry(const struct ccf_entry *e);
+
+#endif
@@ -0,0 +1,298 @@
+// startup report, see report.h
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "alloc.h"
+#include "report.h"
+#include "shmcache.h"
+
+static const char *phase_names[CCF_PHASE_COUNT] = {
+	"set_program_path",
+	"Py_Initialize",
+	"compute_syspath",
+	"PySys_SetPath",
+	"bootstrap",
+	"main_code",
+	"main",
+	"Py_Finalize",
+	"fast_exit",
+};
+
+#define MAX_EXIT_FUNCS 8
+
+static struct {
+	int registered;
+	int count;
+	void (*funcs[MAX_EXIT_FUNCS])(void);
+} exit_funcs;
+
+struct phase {
+	long long begin;
+	long long end;
+};
+
+static struct {
+	char *output;
+	int markers;
+	long long start;
+	struct rusage usage;
+	struct phase phases[CCF_PHASE_COUNT];
+	int have_alloc;
+	struct ccf_alloc_info alloc;	// when __main__ finished
+	int have_memory;
+	struct ccf_memory_info memory;
+	int have_shm_cache;
+	struct ccf_shm_cache_info shm_cache;
+	int have_skipped;
+	size_t skipped_objects;
+	size_t skipped_heap_bytes;
+} report;
+
+// an access() that fails and shows up in strace output, the begin and end
+// markers bracket the system calls of a phase
+static void marker(const char *what, enum ccf_phase phase)
+{
+	char path[64];
+
+	snprintf(path, sizeof(path), "/ccfreeze-phase/%s/%s", what, phase_names[phase]);
+	access(path, F_OK);
+}
+
+long long ccf_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void ccf_phase_begin(enum ccf_phase phase)
+{
+	if (report.markers) {
+		marker("begin", phase);
+	}
+	if (report.output && !report.phases[phase].begin) {
+		report.phases[phase].begin = ccf_now();
+	}
+}
+
+void ccf_phase_end(enum ccf_phase phase)
+{
+	if (report.markers) {
+		marker("end", phase);
+	}
+	if (report.output && report.phases[phase].begin && !report.phases[phase].end) {
+		report.phases[phase].end = ccf_now();
+		if (phase == CCF_PHASE_MAIN) {
+			report.have_alloc = ccf_alloc_info(&report.alloc);
+			report.have_memory = ccf_memory_info(&report.memory);
+			report.have_shm_cache = ccf_shm_cache_info(&report.shm_cache);
+		}
+	}
+}
+
+int ccf_report_enabled(void)
+{
+	return report.output != 0;
+}
+
+void ccf_report_skipped(size_t objects)
+{
+	struct ccf_alloc_info a;
+
+	if (!report.output) {
+		return;
+	}
+	report.have_skipped = 1;
+	report.skipped_objects = objects;
+	if (ccf_alloc_info(&a)) {
+		report.skipped_heap_bytes = a.used_bytes + a.mmap_bytes;
+	}
+}
+
+// a line written at once, see ccf_report_write
+struct buffer {
+	char data[PIPE_BUF];
+	size_t len;
+};
+
+static void append(struct buffer *b, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(b->data + b->len, sizeof(b->data) - b->len, fmt, ap);
+	va_end(ap);
+	if (n > 0) {
+		b->len += n;
+		if (b->len >= sizeof(b->data)) {
+			b->len = sizeof(b->data) - 1;
+		}
+	}
+}
+
+void ccf_run_atexit(void)
+{
+	while (exit_funcs.count) {
+		exit_funcs.funcs[--exit_funcs.count]();
+	}
+}
+
+void ccf_atexit(void (*func)(void))
+{
+	if (!exit_funcs.registered) {
+		atexit(ccf_run_atexit);
+		exit_funcs.registered = 1;
+	}
+	if (exit_funcs.count < MAX_EXIT_FUNCS) {
+		exit_funcs.funcs[exit_funcs.count++] = func;
+	}
+}
+
+void ccf_report_write(const char *output, const char *data, size_t len)
+{
+	char *p;
+	long fd;
+	ssize_t n;
+	int opened = 0;
+
+	fd = strtol(output, &p, 10);
+	if (*p || p == output) {
+		fd = open(output, O_WRONLY | O_APPEND | O_CREAT, 0666);
+		if (fd < 0) {
+			return;
+		}
+		opened = 1;
+	}
+	// a short write is continued, records longer than PIPE_BUF may then
+	// interleave with those of other processes writing to the same pipe
+	while (len) {
+		n = write(fd, data, len);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		data += n;
+		len -= n;
+	}
+	if (opened) {
+		close(fd);
+	}
+}
+
+static long long usec(const struct timeval *tv)
+{
+	return tv->tv_sec * 1000000LL + tv->tv_usec;
+}
+
+static void write_report(void)
+{
+	struct buffer b;
+	struct rusage ru;
+	long long end = ccf_now();
+	const char *sep = "";
+	int i;
+
+	if (!report.output) {
+		return;
+	}
+	getrusage(RUSAGE_SELF, &ru);
+
+	b.len = 0;
+	append(&b, "{\"pid\": %d, \"start_ns\": %lld, \"total_ns\": %lld, \"phases\": {",
+	       (int)getpid(), report.start, end - report.start);
+	for (i = 0; i < CCF_PHASE_COUNT; i++) {
+		const struct phase *ph = &report.phases[i];
+
+		if (!ph->begin) {
+			continue;
+		}
+		// still running when the program exited, e.g. through sys.exit()
+		append(&b, "%s\"%s\": {\"start_ns\": %lld, \"duration_ns\": %lld}", sep,
+		       phase_names[i], ph->begin - report.start, (ph->end ? ph->end : end) - ph->begin);
+		sep = ", ";
+	}
+	append(&b, "}, ");
+	if (report.have_alloc) {
+		const struct ccf_alloc_info *a = &report.alloc;
+
+		append(&b, "\"malloc\": {\"heap_bytes\": %lu, \"used_bytes\": %lu, "
+		       "\"free_bytes\": %lu, \"free_blocks\": %lu, \"releasable_bytes\": %lu, "
+		       "\"mmap_bytes\": %lu, \"mmap_blocks\": %lu}, ",
+		       (unsigned long)a->heap_bytes, (unsigned long)a->used_bytes,
+		       (unsigned long)a->free_bytes, (unsigned long)a->free_blocks,
+		       (unsigned long)a->releasable_bytes, (unsigned long)a->mmap_bytes,
+		       (unsigned long)a->mmap_blocks);
+	}
+	if (report.have_memory) {
+		const struct ccf_memory_info *m = &report.memory;
+
+		append(&b, "\"memory\": {\"rss\": %lu, \"pss\": %lu, \"shared_clean\": %lu, "
+		       "\"shared_dirty\": %lu, \"private_clean\": %lu, \"private_dirty\": %lu, "
+		       "\"swap\": %lu}, ",
+		       (unsigned long)m->rss, (unsigned long)m->pss, (unsigned long)m->shared_clean,
+		       (unsigned long)m->shared_dirty, (unsigned long)m->private_clean,
+		       (unsigned long)m->private_dirty, (unsigned long)m->swap);
+	}
+	if (report.have_shm_cache) {
+		const struct ccf_shm_cache_info *c = &report.shm_cache;
+
+		append(&b, "\"shm_cache\": {\"hits\": %lu, \"misses\": %lu, \"stored\": %lu, "
+		       "\"used_bytes\": %lu, \"size\": %lu}, ",
+		       (unsigned long)c->hits, (unsigned long)c->misses, (unsigned long)c->stored,
+		       (unsigned long)c->used_bytes, (unsigned long)c->size);
+	}
+	if (report.have_skipped) {
+		append(&b, "\"fast_exit_skipped\": {\"gc_objects\": %lu, \"heap_bytes\": %lu}, ",
+		       (unsigned long)report.skipped_objects, (unsigned long)report.skipped_heap_bytes);
+	}
+	append(&b, "\"rusage\": {\"utime_us\": %lld, \"stime_us\": %lld, \"maxrss_kb\": %ld, "
+	       "\"minflt\": %ld, \"majflt\": %ld, \"inblock\": %ld, \"oublock\": %ld, "
+	       "\"nvcsw\": %ld, \"nivcsw\": %ld}}\n",
+	       usec(&ru.ru_utime) - usec(&report.usage.ru_utime),
+	       usec(&ru.ru_stime) - usec(&report.usage.ru_stime),
+	       ru.ru_maxrss,
+	       ru.ru_minflt - report.usage.ru_minflt,
+	       ru.ru_majflt - report.usage.ru_majflt,
+	       ru.ru_inblock - report.usage.ru_inblock,
+	       ru.ru_oublock - report.usage.ru_oublock,
+	       ru.ru_nvcsw - report.usage.ru_nvcsw,
+	       ru.ru_nivcsw - report.usage.ru_nivcsw);
+	if (b.data[b.len - 1] != '\n') {
+		b.data[b.len - 1] = '\n';
+	}
+
+	ccf_report_write(report.output, b.data, b.len);
+}
+
+void ccf_report_init(void)
+{
+	static int registered = 0;
+	const char *output = getenv(CCF_REPORT_ENV);
+
+	free(report.output);
+	memset(&report, 0, sizeof(report));
+	report.markers = getenv(CCF_MARKERS_ENV) != 0;
+	if (!output || !*output) {
+		return;
+	}
+	report.output = strdup(output);
+	report.start = ccf_now();
+	getrusage(RUSAGE_SELF, &report.usage);
+	if (!registered) {
+		ccf_atexit(write_report);
+		registered = 1;
+	}
+}
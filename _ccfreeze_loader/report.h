@@ -0,0 +1,72 @@
+// startup report
+//
+// With CCFREEZE_STARTUP_REPORT set to a file name or to the number of an
+// open file descriptor, the loader appends one line of JSON at exit with
+// the monotonic start time and duration of each startup phase in
+// nanoseconds, the getrusage() counters used by the process and the
+// counters of the malloc heap, of shared and private pages and of the
+// shared cache when __main__ finished (see alloc.h and shmcache.h).
+//
+// After a fast exit, fast_exit_skipped has what Py_Finalize would have torn
+// down and the fast exit saved: the objects tracked by the cyclic collector,
+// which excludes strings, numbers and other objects without references,
+// and the bytes of the malloc heap in use. Py_Finalize's time grows with
+// both, compare with the Py_Finalize phase of a run without exit=fast.
+//
+// With CCFREEZE_PHASE_MARKERS set, each phase also begins and ends with a
+// failing access("/ccfreeze-phase/begin/<phase>") and ".../end/<phase>",
+// which bracket its system calls in strace output (see bench/syscalls.py).
+
+#ifndef CCFREEZE_REPORT_H
+#define CCFREEZE_REPORT_H
+
+#include <stddef.h>
+
+#define CCF_REPORT_ENV "CCFREEZE_STARTUP_REPORT"
+#define CCF_MARKERS_ENV "CCFREEZE_PHASE_MARKERS"
+
+enum ccf_phase {
+	CCF_PHASE_PROGRAM_PATH,
+	CCF_PHASE_INITIALIZE,
+	CCF_PHASE_SYSPATH,
+	CCF_PHASE_SET_PATH,
+	CCF_PHASE_BOOTSTRAP,
+	CCF_PHASE_MAIN_CODE,
+	CCF_PHASE_MAIN,
+	CCF_PHASE_FINALIZE,
+	CCF_PHASE_FAST_EXIT,
+	CCF_PHASE_COUNT
+};
+
+// start a report if CCF_REPORT_ENV is set. Calling this again, e.g. in a
+// forked child, discards what has been recorded so far.
+void ccf_report_init(void);
+
+// the phases nest, but each one is only recorded once
+void ccf_phase_begin(enum ccf_phase phase);
+void ccf_phase_end(enum ccf_phase phase);
+
+// CLOCK_MONOTONIC in nanoseconds
+long long ccf_now(void);
+
+// like atexit(), but ccf_run_atexit() can run func before _exit()
+void ccf_atexit(void (*func)(void));
+// run the functions registered with ccf_atexit, last one first. Each runs
+// at most once.
+void ccf_run_atexit(void);
+
+// 1 if a report is being recorded
+int ccf_report_enabled(void);
+
+// record what a fast exit skips, objects being the number of objects the
+// collector tracks
+void ccf_report_skipped(size_t objects);
+
+// append len bytes to output, a file name or a file descriptor number, in
+// one write(). The writes of concurrent processes do not interleave on a
+// file opened by name, which gets O_APPEND, or on a pipe if len is at most
+// PIPE_BUF. Records are kept below that, the trace and the access record
+// (see trace.h and record.h) are written in larger chunks.
+void ccf_report_write(const char *output, const char *data, size_t len);
+
+#endif
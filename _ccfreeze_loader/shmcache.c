@@ -0,0 +1,351 @@
+// inflated members shared between processes, see shmcache.h
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "options.h"
+#include "shmcache.h"
+
+#define SHM_MAGIC "CCFSHM\0\1"
+#define SHM_VERSION 1
+#define ALIGN 16
+#define MAX_PROBES 64
+
+struct header {
+	char magic[8];
+	uint32_t version;
+	uint32_t nslots;
+	uint64_t size;		// of the file
+	uint64_t archive_size;
+	uint32_t checksum;	// of the archive
+	uint32_t reserved;
+	uint64_t used;		// bytes reserved so far, bumped atomically
+};
+// followed by uint64_t slots[nslots], the offsets of the records, 0 if
+// the slot is empty
+
+struct record {
+	uint64_t size;		// of the data
+	uint32_t crc;
+	uint32_t name_len;
+	// name, then the data at the next multiple of ALIGN
+};
+
+// the file is mapped twice: read-only for lookups and the data handed out,
+// writable only for ccf_shm_cache_put
+static struct {
+	const unsigned char *map;
+	unsigned char *wmap;
+	size_t size;
+	struct header *header;		// in wmap
+	const uint64_t *slots;
+	uint64_t *wslots;
+	unsigned int mask;
+	size_t hits;			// the counters are bumped atomically,
+	size_t misses;			// prefetch workers call put too
+	size_t stored;
+} cache;
+
+static size_t align(size_t n)
+{
+	return (n + ALIGN - 1) & ~(size_t)(ALIGN - 1);
+}
+
+static unsigned int hash(const char *s, size_t len)
+{
+	unsigned int h = 2166136261U;
+
+	while (len--) {
+		h = (h ^ (unsigned char)*s++) * 16777619U;
+	}
+	return h;
+}
+
+static size_t data_offset(size_t name_len)
+{
+	return align(sizeof(struct record) + name_len);
+}
+
+// the record at offset off if it holds e
+static const struct record *record_of(uint64_t off, const struct ccf_entry *e)
+{
+	const struct record *r = (const struct record *)(cache.map + off);
+	size_t need = data_offset(e->name_len) + e->usize;
+
+	if (off > cache.size || cache.size - off < need) {
+		return 0;
+	}
+	if (r->size != e->usize || r->crc != e->crc || r->name_len != e->name_len
+	    || memcmp(r + 1, e->name, e->name_len) != 0) {
+		return 0;
+	}
+	return r;
+}
+
+static const struct record *lookup(const struct ccf_entry *e)
+{
+	unsigned int h = hash(e->name, e->name_len), i;
+	const struct record *r;
+	uint64_t off;
+
+	for (i = 0; i < MAX_PROBES; i++) {
+		off = __atomic_load_n(&cache.slots[(h + i) & cache.mask], __ATOMIC_ACQUIRE);
+		if (!off) {
+			return 0;
+		}
+		r = record_of(off, e);
+		if (r) {
+			return r;
+		}
+	}
+	return 0;
+}
+
+static const void *record_data(const struct record *r)
+{
+	return (const unsigned char *)r + data_offset(r->name_len);
+}
+
+const void *ccf_shm_cache_get(const struct ccf_entry *e)
+{
+	const struct record *r;
+
+	if (!cache.map || e->method == CCF_STORED) {
+		return 0;
+	}
+	r = lookup(e);
+	if (!r) {
+		return 0;
+	}
+	__atomic_fetch_add(&cache.hits, 1, __ATOMIC_RELAXED);
+	return record_data(r);
+}
+
+int ccf_shm_cache_has(const struct ccf_entry *e)
+{
+	return cache.map && e->method != CCF_STORED && lookup(e) != 0;
+}
+
+const void *ccf_shm_cache_put(const struct ccf_entry *e, const void *data)
+{
+	unsigned int h = hash(e->name, e->name_len), i;
+	const struct record *r;
+	struct record *rec;
+	uint64_t off, expected;
+	size_t need;
+
+	if (!cache.map || e->method == CCF_STORED || !e->usize) {
+		return 0;
+	}
+	r = lookup(e);
+	if (r) {
+		__atomic_fetch_add(&cache.hits, 1, __ATOMIC_RELAXED);
+		return record_data(r);
+	}
+	__atomic_fetch_add(&cache.misses, 1, __ATOMIC_RELAXED);
+
+	need = align(data_offset(e->name_len) + e->usize);
+	off = __atomic_fetch_add(&cache.header->used, need, __ATOMIC_RELAXED);
+	if (off > cache.size || cache.size - off < need) {
+		return 0;
+	}
+	rec = (struct record *)(cache.wmap + off);
+	rec->size = e->usize;
+	rec->crc = e->crc;
+	rec->name_len = e->name_len;
+	memcpy(rec + 1, e->name, e->name_len);
+	memcpy(cache.wmap + off + data_offset(e->name_len), data, e->usize);
+
+	for (i = 0; i < MAX_PROBES; i++) {
+		expected = 0;
+		if (__atomic_compare_exchange_n(&cache.wslots[(h + i) & cache.mask], &expected, off,
+						0, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+			__atomic_fetch_add(&cache.stored, 1, __ATOMIC_RELAXED);
+			return record_data((const struct record *)(cache.map + off));
+		}
+		// another process was faster, the space is lost
+		r = record_of(expected, e);
+		if (r) {
+			return record_data(r);
+		}
+	}
+	return 0;
+}
+
+int ccf_shm_cache_info(struct ccf_shm_cache_info *info)
+{
+	uint64_t used;
+
+	if (!cache.map) {
+		return 0;
+	}
+	used = __atomic_load_n(&cache.header->used, __ATOMIC_RELAXED);
+	info->hits = __atomic_load_n(&cache.hits, __ATOMIC_RELAXED);
+	info->misses = __atomic_load_n(&cache.misses, __ATOMIC_RELAXED);
+	info->stored = __atomic_load_n(&cache.stored, __ATOMIC_RELAXED);
+	info->used_bytes = used < cache.size ? used : cache.size;
+	info->size = cache.size;
+	return 1;
+}
+
+static int attach(int fd, size_t size, unsigned int nslots)
+{
+	void *map, *wmap;
+
+	map = mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		return -1;
+	}
+	wmap = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (wmap == MAP_FAILED) {
+		munmap(map, size);
+		return -1;
+	}
+	cache.map = map;
+	cache.wmap = wmap;
+	cache.size = size;
+	cache.header = wmap;
+	cache.slots = (const uint64_t *)(cache.map + sizeof(struct header));
+	cache.wslots = (uint64_t *)(cache.wmap + sizeof(struct header));
+	cache.mask = nslots - 1;
+	return 0;
+}
+
+// map the cache at path if it is ours and belongs to ar. Returns -1 if
+// there is no such file.
+static int map_existing(const char *path, const struct ccf_archive *ar, unsigned int checksum)
+{
+	struct header h;
+	struct stat st;
+	int fd;
+
+	fd = open(path, O_RDWR | O_CLOEXEC | O_NOFOLLOW);
+	if (fd < 0) {
+		return errno == ENOENT ? -1 : 0;
+	}
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_uid != geteuid()
+	    || (st.st_mode & 077) || pread(fd, &h, sizeof(h), 0) != sizeof(h)
+	    || memcmp(h.magic, SHM_MAGIC, 8) != 0 || h.version != SHM_VERSION
+	    || h.size != (uint64_t)st.st_size || h.archive_size != ar->size
+	    || h.checksum != checksum || !h.nslots || (h.nslots & (h.nslots - 1))
+	    || sizeof(struct header) + h.nslots * sizeof(uint64_t) > h.size) {
+		close(fd);
+		return 0;
+	}
+	attach(fd, st.st_size, h.nslots);
+	close(fd);
+	return 1;
+}
+
+// files of other versions of the archive
+static void remove_stale(const char *dir, const char *prefix, const char *name)
+{
+	struct dirent *ent;
+	char path[PATH_MAX];
+	DIR *d;
+
+	d = opendir(dir);
+	if (!d) {
+		return;
+	}
+	while ((ent = readdir(d))) {
+		// skip the files being created, see create()
+		if (strncmp(ent->d_name, prefix, strlen(prefix)) != 0
+		    || strcmp(ent->d_name, name) == 0 || strchr(ent->d_name, '.')) {
+			continue;
+		}
+		if (snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name) < (int)sizeof(path)) {
+			unlink(path);
+		}
+	}
+	closedir(d);
+}
+
+// set the file up under a temporary name, then link it into place so
+// that nobody maps it half done. Returns 0 if another process won.
+static int create(const char *path, size_t size, const struct ccf_archive *ar,
+		  unsigned int checksum)
+{
+	char tmp[PATH_MAX];
+	struct header h;
+	unsigned int nslots;
+	int fd, err;
+
+	nslots = 256;
+	while (nslots < size / 4096) {
+		nslots *= 2;
+	}
+	if (sizeof(struct header) + nslots * sizeof(uint64_t) >= size
+	    || snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid()) >= (int)sizeof(tmp)) {
+		return 1;
+	}
+	fd = open(tmp, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC | O_NOFOLLOW, 0600);
+	if (fd < 0) {
+		return 1;
+	}
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, SHM_MAGIC, 8);
+	h.version = SHM_VERSION;
+	h.nslots = nslots;
+	h.size = size;
+	h.archive_size = ar->size;
+	h.checksum = checksum;
+	h.used = align(sizeof(struct header) + nslots * sizeof(uint64_t));
+	if (ftruncate(fd, size) != 0 || pwrite(fd, &h, sizeof(h), 0) != sizeof(h)
+	    || link(tmp, path) != 0) {
+		err = errno;
+		close(fd);
+		unlink(tmp);
+		return err == EEXIST ? 0 : 1;
+	}
+	unlink(tmp);
+	attach(fd, size, nslots);
+	close(fd);
+	return 1;
+}
+
+void ccf_shm_cache_open(struct ccf_archive *ar)
+{
+	const char *dir = ccf_option("shm_cache_dir");
+	long size = ccf_option_long("shm_cache_size", 64 << 20);
+	char prefix[64], name[96], path[PATH_MAX];
+	unsigned int checksum;
+	int i, found;
+
+	if (cache.map || !ar || !ccf_option_long("shm_cache", 0) || size <= 0) {
+		return;
+	}
+	if (!dir || !*dir) {
+		dir = "/dev/shm";
+	}
+	checksum = ccf_archive_checksum(ar);
+	snprintf(prefix, sizeof(prefix), "%s%u-%08x-", CCF_SHM_PREFIX, (unsigned int)geteuid(),
+		 hash(ar->path, strlen(ar->path)));
+	snprintf(name, sizeof(name), "%s%08x%08lx", prefix, checksum, (unsigned long)ar->size);
+	if (snprintf(path, sizeof(path), "%s/%s", dir, name) >= (int)sizeof(path)) {
+		return;
+	}
+
+	// lost the race to create it at most once, then it's there
+	for (i = 0; i < 2; i++) {
+		found = map_existing(path, ar, checksum);
+		if (found >= 0) {
+			return;
+		}
+		if (create(path, size, ar, checksum)) {
+			if (cache.map) {
+				remove_stale(dir, prefix, name);
+			}
+			return;
+		}
+	}
+}
@@ -0,0 +1,60 @@
+// inflated members shared between processes
+//
+// With the freeze-time option shm_cache=1, the members the loader inflates
+// are kept in a file in shm_cache_dir (/dev/shm by default), which every
+// process of the same user running the same archive maps. The first one
+// to inflate a member appends it there, the others import it straight
+// from the mapping instead of inflating a copy of their own, so it is in
+// memory only once.
+//
+// The file is named CCF_SHM_PREFIX<uid>-<path>-<checksum>, after hashes
+// of the archive's path and of its content (see ccf_archive_checksum), so
+// a changed archive gets a new file. Creating it removes the files of the
+// earlier versions of the same archive: processes that still have one of
+// them mapped keep using it.
+//
+// Nothing in there is ever locked or rewritten. Space is reserved by
+// bumping a counter, the member is copied in and then published by
+// compare-and-swapping its offset into an open addressing table. Each
+// process maps the file twice: the lookups and the data they return go
+// through a read-only mapping, only ccf_shm_cache_put writes through the
+// other one. The file is full at shm_cache_size bytes (default 64 MiB),
+// members that do not fit any more are inflated privately as before.
+//
+// The startup report counts the members taken from and put into the
+// cache.
+
+#ifndef CCFREEZE_SHMCACHE_H
+#define CCFREEZE_SHMCACHE_H
+
+#include "archive.h"
+
+#define CCF_SHM_PREFIX "ccfreeze-"
+
+struct ccf_shm_cache_info {
+	size_t hits;		// members taken from the cache
+	size_t misses;		// members inflated by this process
+	size_t stored;		// of which were put into the cache
+	size_t used_bytes;	// of the file, by all processes
+	size_t size;
+};
+
+// map or create the cache of ar, which may be 0, if the option is set
+void ccf_shm_cache_open(struct ccf_archive *ar);
+
+// the inflated data of e if it is in the cache, 0 otherwise. It stays
+// mapped for the lifetime of the process.
+const void *ccf_shm_cache_get(const struct ccf_entry *e);
+
+// like ccf_shm_cache_get, but only tells whether e is there and does not
+// count it. Safe to call from any thread.
+int ccf_shm_cache_has(const struct ccf_entry *e);
+
+// copy the inflated data of e into the cache. Returns the copy, or 0 if
+// there is no cache or no room left in it.
+const void *ccf_shm_cache_put(const struct ccf_entry *e, const void *data);
+
+// returns 0 if there is no cache
+int ccf_shm_cache_info(struct ccf_shm_cache_info *info);
+
+#endif
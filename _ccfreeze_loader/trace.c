@@ -0,0 +1,157 @@
+// import trace, see trace.h
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "report.h"
+#include "trace.h"
+
+#define MAX_DEPTH 128
+#define BUFFER_SIZE (64 * 1024)
+// enough for a record, unless the stack of module names is very long
+#define RECORD_SIZE 4096
+
+static struct {
+	char *output;
+	long long start;
+	int depth;
+	struct ccf_trace_frame frames[MAX_DEPTH];
+	char *buf;
+	size_t len;
+} trace;
+
+static void flush(void)
+{
+	if (trace.output && trace.len) {
+		ccf_report_write(trace.output, trace.buf, trace.len);
+	}
+	trace.len = 0;
+}
+
+static void append(const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(trace.buf + trace.len, BUFFER_SIZE - trace.len, fmt, ap);
+	va_end(ap);
+	if (n > 0) {
+		trace.len += n;
+		if (trace.len >= BUFFER_SIZE) {
+			trace.len = BUFFER_SIZE - 1;
+		}
+	}
+}
+
+static void append_string(const char *s, size_t len)
+{
+	size_t i;
+
+	append("\"");
+	for (i = 0; i < len; i++) {
+		unsigned char c = s[i];
+
+		if (c == '"' || c == '\\') {
+			append("\\%c", c);
+		} else if (c < 0x20) {
+			append("\\u%04x", c);
+		} else {
+			append("%c", c);
+		}
+	}
+	append("\"");
+}
+
+void ccf_trace_init(void)
+{
+	static int registered = 0;
+	const char *output = getenv(CCF_TRACE_ENV);
+
+	free(trace.output);
+	free(trace.buf);
+	memset(&trace, 0, sizeof(trace));
+	if (!output || !*output) {
+		return;
+	}
+	trace.buf = malloc(BUFFER_SIZE);
+	trace.output = trace.buf ? strdup(output) : 0;
+	if (!trace.output) {
+		return;
+	}
+	trace.start = ccf_now();
+	if (!registered) {
+		ccf_atexit(flush);
+		registered = 1;
+	}
+}
+
+struct ccf_trace_frame *ccf_trace_push(const char *module)
+{
+	struct ccf_trace_frame *f;
+
+	if (!trace.output || trace.depth == MAX_DEPTH) {
+		return 0;
+	}
+	f = &trace.frames[trace.depth++];
+	memset(f, 0, sizeof(*f));
+	f->module = module;
+	f->start = ccf_now();
+	return f;
+}
+
+void ccf_trace_pop(struct ccf_trace_frame *f, int ok)
+{
+	long long end = ccf_now(), total = end - f->start;
+	int i, depth = --trace.depth;
+
+	if (depth) {
+		trace.frames[depth - 1].children_ns += total;
+	}
+	if (BUFFER_SIZE - trace.len < RECORD_SIZE) {
+		flush();
+	}
+
+	append("{\"module\": ");
+	append_string(f->module, strlen(f->module));
+	append(", \"parent\": ");
+	if (depth) {
+		append_string(trace.frames[depth - 1].module, strlen(trace.frames[depth - 1].module));
+	} else {
+		append("null");
+	}
+	append(", \"stack\": \"");
+	for (i = 0; i <= depth; i++) {
+		append("%s%s", i ? ";" : "", trace.frames[i].module);
+	}
+	append("\", \"depth\": %d, \"entry\": ", depth);
+	if (f->entry) {
+		append_string(f->entry, f->entry_len);
+	} else {
+		append("null");
+	}
+	append(", \"csize\": %lu, \"usize\": %lu, \"start_ns\": %lld, \"total_ns\": %lld, "
+	       "\"self_ns\": %lld, \"read_ns\": %lld, \"decompress_ns\": %lld, "
+	       "\"unmarshal_ns\": %lld, \"exec_ns\": %lld, \"ok\": %s}\n",
+	       (unsigned long)f->csize, (unsigned long)f->usize, f->start - trace.start, total,
+	       total - f->children_ns, f->read_ns, f->decompress_ns, f->unmarshal_ns,
+	       f->exec_start ? end - f->exec_start : 0, ok ? "true" : "false");
+	if (trace.buf[trace.len - 1] != '\n') {
+		trace.buf[trace.len - 1] = '\n';
+	}
+}
+
+void ccf_trace_touch(const unsigned char *p, size_t len)
+{
+	volatile unsigned char sum = 0;
+	size_t i;
+
+	for (i = 0; i < len; i += 4096) {
+		sum += p[i];
+	}
+	if (len) {
+		sum += p[len - 1];
+	}
+}
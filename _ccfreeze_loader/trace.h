@@ -0,0 +1,59 @@
+// import trace
+//
+// With CCFREEZE_IMPORT_TRACE set to a file name or to the number of an
+// open file descriptor, the archive importer writes one line of JSON for
+// every module it loads, when the module's body has finished executing:
+//
+//	module, parent	the module and the module whose import started it,
+//			null for imports from __main__
+//	stack		the chain of imports separated by ';', as used by
+//			flame graph tools
+//	depth		nesting level, 0 for imports from __main__
+//	entry		the archive member the code came from
+//	csize, usize	compressed and uncompressed size of the member
+//	start_ns	monotonic time since the trace started
+//	total_ns	wall time of the whole import, nested imports included
+//	self_ns		total_ns minus the total_ns of nested imports
+//	read_ns		faulting in the member's bytes
+//	decompress_ns	inflating them
+//	unmarshal_ns	unmarshalling, or compiling a source file
+//	exec_ns		executing the module body, nested imports included
+//	ok		false if the import raised an exception
+//
+// Records are buffered and written in blocks and at exit.
+
+#ifndef CCFREEZE_TRACE_H
+#define CCFREEZE_TRACE_H
+
+#include <stddef.h>
+
+#define CCF_TRACE_ENV "CCFREEZE_IMPORT_TRACE"
+
+struct ccf_trace_frame {
+	const char *module;
+	const char *entry;	// not NUL terminated
+	unsigned int entry_len;
+	size_t csize;
+	size_t usize;
+	long long start;
+	long long read_ns;
+	long long decompress_ns;
+	long long unmarshal_ns;
+	long long exec_start;
+	long long children_ns;
+};
+
+// start tracing if CCF_TRACE_ENV is set. Calling this again, e.g. in a
+// forked child, discards unwritten records.
+void ccf_trace_init(void);
+
+// start the import of module, returns 0 if tracing is off
+struct ccf_trace_frame *ccf_trace_push(const char *module);
+// record the frame on top of the stack
+void ccf_trace_pop(struct ccf_trace_frame *frame, int ok);
+
+// read one byte per page of len bytes at p, so that the page faults are
+// accounted to read_ns
+void ccf_trace_touch(const unsigned char *p, size_t len);
+
+#endif
@@ -0,0 +1,579 @@
+// pre-fork server mode, see zygote.h
+
+#include <Python.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "gcfreeze.h"
+#include "importer.h"
+#include "record.h"
+#include "report.h"
+#include "trace.h"
+#include "zygote.h"
+
+extern char **environ;
+
+#define REQUEST_MAGIC "CCFZYGO1"
+#define MAX_REQUEST (16 << 20)
+
+// a request is this header, sent together with the client's file
+// descriptors 0, 1 and 2, followed by size bytes of NUL terminated strings:
+// the path of the executable, the working directory, argc arguments and
+// envc environment entries. The server answers with the u32 pid of the
+// child, 0 if it refuses the request, and then the child's wait status.
+struct request {
+	char magic[8];
+	unsigned int argc;
+	unsigned int envc;
+	unsigned int size;
+};
+
+struct parsed_request {
+	char *buf;
+	const char *exe;
+	const char *cwd;
+	char **argv;
+	char **env;
+	int argc;
+	int fds[3];
+};
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+
+	while (len) {
+		ssize_t n = write(fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+// -1 on errors and if the peer closes the connection early
+static int read_all(int fd, void *buf, size_t len)
+{
+	char *p = buf;
+
+	while (len) {
+		ssize_t n = read(fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		if (n == 0) {
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int exe_path(char *path)
+{
+	ssize_t n = readlink("/proc/self/exe", path, PATH_MAX);
+
+	if (n < 0) {
+		return -1;
+	}
+	path[n] = 0;
+	return 0;
+}
+
+static int socket_address(const char *path, struct sockaddr_un *addr)
+{
+	if (strlen(path) >= sizeof(addr->sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	strcpy(addr->sun_path, path);
+	return 0;
+}
+
+// --- client
+
+static volatile sig_atomic_t child_pid = 0;
+
+static const int forwarded_signals[] = {SIGHUP, SIGINT, SIGQUIT, SIGTERM, SIGUSR1, SIGUSR2, 0};
+
+static void forward_signal(int sig)
+{
+	if (child_pid > 0) {
+		kill(child_pid, sig);
+	}
+}
+
+static int send_request(int fd, const struct request *req, const char *buf)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	union {
+		struct cmsghdr h;
+		char buf[CMSG_SPACE(3 * sizeof(int))];
+	} ctl;
+	struct cmsghdr *cmsg;
+	int fds[3] = {0, 1, 2};
+	ssize_t n;
+
+	memset(&msg, 0, sizeof(msg));
+	memset(&ctl, 0, sizeof(ctl));
+	iov.iov_base = (void *)req;
+	iov.iov_len = sizeof(*req);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctl.buf;
+	msg.msg_controllen = sizeof(ctl.buf);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	do {
+		n = sendmsg(fd, &msg, 0);
+	} while (n < 0 && errno == EINTR);
+	if (n < 0) {
+		return -1;
+	}
+	if ((size_t)n < sizeof(*req) && write_all(fd, (const char *)req + n, sizeof(*req) - n) != 0) {
+		return -1;
+	}
+	return write_all(fd, buf, req->size);
+}
+
+static char *append_string(char *p, const char *s)
+{
+	size_t len = strlen(s) + 1;
+
+	memcpy(p, s, len);
+	return p + len;
+}
+
+void ccf_zygote_client(int argc, char **argv)
+{
+	const char *path = getenv(CCF_ZYGOTE_ENV);
+	char exe[PATH_MAX + 1], cwd[PATH_MAX + 1];
+	struct sockaddr_un addr;
+	struct sigaction sa;
+	struct request req;
+	unsigned int pid;
+	char *buf, *p;
+	size_t size;
+	int fd, i, envc, status;
+
+	if (!path || !*path || socket_address(path, &addr) != 0 || exe_path(exe) != 0) {
+		return;
+	}
+	if (!getcwd(cwd, sizeof(cwd))) {
+		cwd[0] = 0;
+	}
+
+	size = strlen(exe) + strlen(cwd) + 2;
+	for (i = 0; i < argc; i++) {
+		size += strlen(argv[i]) + 1;
+	}
+	for (envc = 0; environ[envc]; envc++) {
+		size += strlen(environ[envc]) + 1;
+	}
+	if (size > MAX_REQUEST || !(buf = malloc(size))) {
+		return;
+	}
+	p = append_string(buf, exe);
+	p = append_string(p, cwd);
+	for (i = 0; i < argc; i++) {
+		p = append_string(p, argv[i]);
+	}
+	for (i = 0; i < envc; i++) {
+		p = append_string(p, environ[i]);
+	}
+
+	memcpy(req.magic, REQUEST_MAGIC, 8);
+	req.argc = argc;
+	req.envc = envc;
+	req.size = size;
+
+	// fall back to starting normally until the zygote has forked a child
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		free(buf);
+		return;
+	}
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0
+	    || send_request(fd, &req, buf) != 0
+	    || read_all(fd, &pid, sizeof(pid)) != 0 || !pid) {
+		close(fd);
+		free(buf);
+		return;
+	}
+	free(buf);
+
+	child_pid = pid;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = forward_signal;
+	sigemptyset(&sa.sa_mask);
+	for (i = 0; forwarded_signals[i]; i++) {
+		sigaction(forwarded_signals[i], &sa, 0);
+	}
+
+	if (read_all(fd, &status, sizeof(status)) != 0) {
+		fprintf(stderr, "Fatal error: lost connection to zygote %s\n", path);
+		exit(1);
+	}
+	if (WIFSIGNALED(status)) {
+		sigset_t set;
+
+		signal(WTERMSIG(status), SIG_DFL);
+		sigemptyset(&set);
+		sigaddset(&set, WTERMSIG(status));
+		sigprocmask(SIG_UNBLOCK, &set, 0);
+		raise(WTERMSIG(status));
+	}
+	exit(WIFEXITED(status) ? WEXITSTATUS(status) : 1);
+}
+
+// --- server
+
+static char server_exe[PATH_MAX + 1];
+
+static int preload(void)
+{
+	const char *names = getenv(CCF_ZYGOTE_PRELOAD_ENV);
+	char *copy, *name, *saveptr;
+	PyObject *mod;
+
+	if (!names || !*names) {
+		return 0;
+	}
+	copy = strdup(names);
+	if (!copy) {
+		PyErr_NoMemory();
+		return -1;
+	}
+	for (name = strtok_r(copy, ", ", &saveptr); name; name = strtok_r(0, ", ", &saveptr)) {
+		mod = PyImport_ImportModule(name);
+		if (!mod) {
+			free(copy);
+			return -1;
+		}
+		Py_DECREF(mod);
+	}
+	free(copy);
+	return 0;
+}
+
+static int listen_socket(const char *path)
+{
+	struct sockaddr_un addr;
+	struct stat st;
+	mode_t mask;
+	int fd, err;
+
+	if (socket_address(path, &addr) != 0) {
+		return -1;
+	}
+	// replace the socket of a previous server, but nothing else
+	if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+		unlink(path);
+	}
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		return -1;
+	}
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+	// only the user running the server may connect
+	mask = umask(077);
+	err = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+	umask(mask);
+	if (err != 0 || listen(fd, SOMAXCONN) != 0) {
+		err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+	return fd;
+}
+
+static void close_fds(int *fds, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (fds[i] >= 0) {
+			close(fds[i]);
+			fds[i] = -1;
+		}
+	}
+}
+
+static int next_string(char **p, const char *end, const char **s)
+{
+	char *nul = memchr(*p, 0, end - *p);
+
+	if (!nul) {
+		return -1;
+	}
+	*s = *p;
+	*p = nul + 1;
+	return 0;
+}
+
+static int receive_request(int conn, struct parsed_request *r)
+{
+	struct request req;
+	struct msghdr msg;
+	struct iovec iov;
+	union {
+		struct cmsghdr h;
+		char buf[CMSG_SPACE(3 * sizeof(int))];
+	} ctl;
+	struct cmsghdr *cmsg;
+	char *p, *end;
+	unsigned int i;
+	ssize_t n;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &req;
+	iov.iov_len = sizeof(req);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctl.buf;
+	msg.msg_controllen = sizeof(ctl.buf);
+	do {
+		n = recvmsg(conn, &msg, 0);
+	} while (n < 0 && errno == EINTR);
+	if (n <= 0) {
+		return -1;
+	}
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS
+	    || cmsg->cmsg_len != CMSG_LEN(3 * sizeof(int))) {
+		return -1;
+	}
+	memcpy(r->fds, CMSG_DATA(cmsg), sizeof(r->fds));
+	// out of the way of 0, 1 and 2 in case the server has closed them
+	for (i = 0; i < 3; i++) {
+		int fd = fcntl(r->fds[i], F_DUPFD, 3);
+		close(r->fds[i]);
+		r->fds[i] = fd;
+		if (fd >= 0) {
+			fcntl(fd, F_SETFD, FD_CLOEXEC);
+		}
+	}
+	if (r->fds[0] < 0 || r->fds[1] < 0 || r->fds[2] < 0
+	    || ((size_t)n < sizeof(req) && read_all(conn, (char *)&req + n, sizeof(req) - n) != 0)
+	    || memcmp(req.magic, REQUEST_MAGIC, 8) != 0 || req.size > MAX_REQUEST
+	    || req.argc > req.size || req.envc > req.size) {
+		return -1;
+	}
+
+	r->buf = malloc(req.size + 1);
+	r->argv = malloc((req.argc + 1) * sizeof(char *));
+	r->env = malloc((req.envc + 1) * sizeof(char *));
+	if (!r->buf || !r->argv || !r->env || read_all(conn, r->buf, req.size) != 0) {
+		return -1;
+	}
+	p = r->buf;
+	end = r->buf + req.size;
+	if (next_string(&p, end, &r->exe) != 0 || next_string(&p, end, &r->cwd) != 0) {
+		return -1;
+	}
+	for (i = 0; i < req.argc; i++) {
+		if (next_string(&p, end, (const char **)&r->argv[i]) != 0) {
+			return -1;
+		}
+	}
+	for (i = 0; i < req.envc; i++) {
+		if (next_string(&p, end, (const char **)&r->env[i]) != 0) {
+			return -1;
+		}
+	}
+	r->argv[req.argc] = 0;
+	r->env[req.envc] = 0;
+	r->argc = req.argc;
+	return 0;
+}
+
+// os.environ was filled at startup, refill it the way posixmodule.c does
+static int update_environ(char **env)
+{
+	PyObject *posix, *d, *k, *v;
+	int i, err = 0;
+
+	posix = PyImport_ImportModule("posix");
+	if (!posix) {
+		return -1;
+	}
+	d = PyObject_GetAttrString(posix, "environ");
+	Py_DECREF(posix);
+	if (!d || !PyDict_Check(d)) {
+		Py_XDECREF(d);
+		return -1;
+	}
+	PyDict_Clear(d);
+	for (i = 0; env[i] && !err; i++) {
+		const char *eq = strchr(env[i], '=');
+
+		if (!eq) {
+			continue;
+		}
+		k = PyString_FromStringAndSize(env[i], eq - env[i]);
+		v = PyString_FromString(eq + 1);
+		if (!k || !v) {
+			err = -1;
+		} else if (!PyDict_GetItem(d, k)) {
+			err = PyDict_SetItem(d, k, v);
+		}
+		Py_XDECREF(k);
+		Py_XDECREF(v);
+	}
+	Py_DECREF(d);
+	return err;
+}
+
+// make the forked child look like it was started by the client
+static int apply_request(struct parsed_request *r)
+{
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		if (dup2(r->fds[i], i) < 0) {
+			PyErr_SetFromErrno(PyExc_OSError);
+			return -1;
+		}
+	}
+	close_fds(r->fds, 3);
+	if (*r->cwd && chdir(r->cwd) != 0) {
+		PyErr_SetFromErrnoWithFilename(PyExc_OSError, (char *)r->cwd);
+		return -1;
+	}
+	environ = r->env;
+	ccf_report_init();
+	ccf_trace_init();
+	ccf_record_init();
+	if (update_environ(r->env) != 0) {
+		return -1;
+	}
+	PySys_SetArgvEx(r->argc, r->argv, 0);
+	ccf_init_encodings();
+	return 0;
+}
+
+// runs in a process forked for each connection. It forks the child that
+// runs __main__ and reports the child's exit status to the client, and
+// only returns in that child.
+static int serve_connection(int conn)
+{
+	struct parsed_request r;
+	unsigned int reply = 0;
+	pid_t pid;
+	int status;
+
+	memset(&r, 0, sizeof(r));
+	r.fds[0] = r.fds[1] = r.fds[2] = -1;
+	if (receive_request(conn, &r) != 0 || strcmp(r.exe, server_exe) != 0) {
+		// a different program, let the client start itself
+		write_all(conn, &reply, sizeof(reply));
+		_exit(0);
+	}
+
+	pid = fork();
+	if (pid == 0) {
+		close(conn);
+		PyOS_AfterFork();
+		return apply_request(&r);
+	}
+	close_fds(r.fds, 3);
+	if (pid < 0) {
+		write_all(conn, &reply, sizeof(reply));
+		_exit(0);
+	}
+
+	reply = pid;
+	write_all(conn, &reply, sizeof(reply));
+	while (waitpid(pid, &status, 0) < 0) {
+		if (errno != EINTR) {
+			_exit(1);
+		}
+	}
+	write_all(conn, &status, sizeof(status));
+	_exit(0);
+}
+
+int ccf_zygote_serve(void)
+{
+	const char *path = getenv(CCF_ZYGOTE_SERVE_ENV);
+	int fd, conn;
+	pid_t pid;
+
+	if (!path || !*path) {
+		return 0;
+	}
+	if (exe_path(server_exe) != 0) {
+		PyErr_SetFromErrnoWithFilename(PyExc_OSError, "/proc/self/exe");
+		return -1;
+	}
+	ccf_gc_pause();
+	if (preload() != 0) {
+		return -1;
+	}
+	ccf_startup_done();
+	fd = listen_socket(path);
+	if (fd < 0) {
+		PyErr_SetFromErrnoWithFilename(PyExc_OSError, (char *)path);
+		return -1;
+	}
+
+	// the per connection processes are reaped automatically
+	signal(SIGCHLD, SIG_IGN);
+	for (;;) {
+		conn = accept(fd, 0, 0);
+		if (conn < 0) {
+			if (errno == EINTR) {
+				if (PyErr_CheckSignals() != 0) {
+					break;
+				}
+				continue;
+			}
+			PyErr_SetFromErrno(PyExc_OSError);
+			break;
+		}
+		fcntl(conn, F_SETFD, FD_CLOEXEC);
+
+		fflush(0);
+		pid = fork();
+		if (pid == 0) {
+			close(fd);
+			signal(SIGCHLD, SIG_DFL);
+			return serve_connection(conn);
+		}
+		close(conn);
+	}
+	close(fd);
+	unlink(path);
+	return -1;
+}
@@ -0,0 +1,36 @@
+// pre-fork server mode
+//
+// A loader started with CCFREEZE_ZYGOTE_SERVE=<socket> initializes Python,
+// imports the comma separated modules in CCFREEZE_ZYGOTE_PRELOAD and then
+// listens on the Unix socket <socket>. A loader started with
+// CCFREEZE_ZYGOTE=<socket> hands its argv, cwd, environment and stdio file
+// descriptors to the server instead of starting Python itself. The server
+// forks a child which runs __main__ with them, and the client exits with
+// the child's exit status or dies from the same signal.
+//
+// The server must not start threads before it forks, and children run in
+// the server's session and process group, without the client's
+// controlling terminal. The client forwards the usual termination signals.
+// One exception: with the stdio option line or full the loader starts a
+// thread that flushes stdout on SIGTERM. It holds no lock while it waits,
+// and a pthread_atfork handler starts a new one in every forked child,
+// the zygote's children included.
+
+#ifndef CCFREEZE_ZYGOTE_H
+#define CCFREEZE_ZYGOTE_H
+
+#define CCF_ZYGOTE_ENV "CCFREEZE_ZYGOTE"
+#define CCF_ZYGOTE_SERVE_ENV "CCFREEZE_ZYGOTE_SERVE"
+#define CCF_ZYGOTE_PRELOAD_ENV "CCFREEZE_ZYGOTE_PRELOAD"
+
+// run argv in the zygote named by CCF_ZYGOTE_ENV and exit with its status.
+// Returns if there is no zygote to connect to or it refused the request.
+void ccf_zygote_client(int argc, char **argv);
+
+// if CCF_ZYGOTE_SERVE_ENV is set, serve requests. Returns 0 when not
+// serving and in every forked child, which then runs __main__ with the
+// client's arguments and stdio, and -1 with a Python exception set if the
+// server fails.
+int ccf_zygote_serve(void);
+
+#endif
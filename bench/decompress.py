@@ -0,0 +1,162 @@
+"""decompression benchmark for the compression methods of the archive
+
+usage: python bench/decompress.py [archive.zip] [options]
+
+Compresses the members of a zip archive, by default .pyc files compiled
+from the standard library of the Python running this script, with deflate,
+zstd and LZ4, each with and without a shared dictionary trained on the
+members (see pack.py compress), and decompresses all of them many times.
+Prints one JSON document with the compressed size and the median
+decompression throughput of each method.
+
+Members are decompressed one by one, the way the loader reads them, so
+the time per member includes a call into the library: through zlib for
+deflate and through ctypes for zstd and LZ4, whose overhead of about a
+microsecond per call favours deflate.
+"""
+
+from __future__ import print_function
+
+import os
+import sys
+import json
+import time
+import zlib
+import ctypes
+import marshal
+import platform
+import zipfile
+
+clock = getattr(time, "perf_counter", time.time)
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+sys.path.insert(0, os.path.dirname(HERE))
+
+from _ccfreeze_loader import pack
+
+try:
+    from importlib.util import MAGIC_NUMBER as PYC_MAGIC
+except ImportError:
+    import imp
+    PYC_MAGIC = imp.get_magic()
+
+
+def stdlib_members(limit):
+    """compiled modules of the standard library, as the bytes of .pyc files"""
+    stdlib = os.path.dirname(os.__file__)
+    members = []
+    for name in sorted(os.listdir(stdlib)):
+        if not name.endswith(".py") or len(members) >= limit:
+            continue
+        path = os.path.join(stdlib, name)
+        try:
+            with open(path, "rb") as f:
+                code = compile(f.read(), path, "exec")
+        except (SyntaxError, ValueError):
+            continue
+        members.append(PYC_MAGIC + b"\0" * 4 + marshal.dumps(code))
+    return members
+
+
+def archive_members(path):
+    with zipfile.ZipFile(path) as z:
+        return [z.read(i) for i in z.infolist()
+                if not i.filename.startswith(pack.META_PREFIX) and i.file_size]
+
+
+class Deflate(object):
+    def __init__(self, level, dictionary):
+        self.level = level or 9
+
+    def compress(self, data):
+        c = zlib.compressobj(self.level, zlib.DEFLATED, -15)
+        return c.compress(data) + c.flush()
+
+    def decompress_into(self, buf, data):
+        return len(zlib.decompress(data, -15))
+
+
+def measure(codec, packed, sizes, rounds):
+    bufs = [ctypes.create_string_buffer(n) for n in sizes]
+    times = []
+    for _ in range(rounds):
+        start = clock()
+        for buf, data in zip(bufs, packed):
+            codec.decompress_into(buf, data)
+        times.append(clock() - start)
+    times.sort()
+    return times[len(times) // 2]
+
+
+def run(args):
+    if args.archive:
+        members = archive_members(args.archive)
+    else:
+        members = stdlib_members(args.members)
+    sizes = [len(m) for m in members]
+    total = sum(sizes)
+
+    results = []
+    for method in args.methods:
+        for dict_size in ([0, args.dict_size] if method != "deflate" else [0]):
+            dictionary = pack.train_dictionary(members, dict_size) if dict_size else None
+            if dict_size and not dictionary:
+                sys.stderr.write("too few members to train a dictionary\n")
+                continue
+            cls = Deflate if method == "deflate" else pack.CODECS[method]
+            codec = cls(args.level, dictionary)
+            packed = [codec.compress(m) for m in members]
+            seconds = measure(codec, packed, sizes, args.rounds)
+            r = {
+                "method": method,
+                "dict_bytes": len(dictionary or b""),
+                "compressed_bytes": sum(len(p) for p in packed),
+                "ratio": float(total) / sum(len(p) for p in packed),
+                "median_ms": seconds * 1000,
+                "mb_per_s": total / seconds / 1e6,
+                "us_per_member": seconds * 1e6 / len(members),
+            }
+            results.append(r)
+            sys.stderr.write("%-8s dict %6d  ratio %5.2f  %8.1f MB/s  %6.2f us/member\n" % (
+                method, r["dict_bytes"], r["ratio"], r["mb_per_s"], r["us_per_member"]))
+
+    doc = {
+        "archive": args.archive,
+        "members": len(members),
+        "uncompressed_bytes": total,
+        "python": sys.version.split()[0],
+        "platform": platform.platform(),
+        "time": int(time.time()),
+        "results": results,
+    }
+    text = json.dumps(doc, indent=1, sort_keys=True)
+    if args.output:
+        with open(args.output, "w") as f:
+            f.write(text + "\n")
+    else:
+        print(text)
+
+
+def main(argv=None):
+    import argparse
+
+    parser = argparse.ArgumentParser(prog="decompress.py", description=__doc__.split("\n")[0])
+    parser.add_argument("archive", nargs="?",
+                        help="zip file whose members to use (default: the standard library)")
+    parser.add_argument("--members", type=int, default=200,
+                        help="standard library modules to use (default: 200)")
+    parser.add_argument("--methods", type=lambda s: s.split(","),
+                        default=["deflate", "zstd", "lz4"], help="deflate,zstd,lz4")
+    parser.add_argument("--level", type=int,
+                        help="compression level (default: 9 for deflate, see pack.py compress)")
+    parser.add_argument("--dict-size", type=int, default=pack.DICT_SIZE,
+                        help="dictionary size (default: %(default)s)")
+    parser.add_argument("--rounds", type=int, default=50,
+                        help="times all members are decompressed (default: 50)")
+    parser.add_argument("-o", "--output", help="write the JSON results here")
+    run(parser.parse_args(argv))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
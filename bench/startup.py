@@ -0,0 +1,398 @@
+"""startup benchmark for the loader executables built by setup.py
+
+usage: python bench/startup.py [--loader build/.../console.exe] [options]
+
+Freezes synthetic programs of several sizes with the loader and runs each
+of them many times, measuring wall time, page faults, peak RSS and, if
+strace is installed, system calls. Prints one JSON document with medians
+and p99s; 'compare OLD NEW' prints the ratio of the medians of two such
+documents, e.g. before and after a loader change.
+
+The archive holds .pyc files compiled by the Python running this script,
+which therefore must be the Python the loader was built for.
+
+Cold runs evict the program's files (loader, archive, extensions) from the
+page cache with posix_fadvise(POSIX_FADV_DONTNEED) before each run; with
+--drop-caches and root they drop the whole page cache instead.
+"""
+
+from __future__ import print_function
+
+import os
+import sys
+import glob
+import json
+import time
+import errno
+import shutil
+import struct
+import hashlib
+import marshal
+import platform
+import tempfile
+import subprocess
+import zipfile
+
+clock = getattr(time, "perf_counter", time.time)
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+sys.path.insert(0, os.path.dirname(HERE))
+
+from _ccfreeze_loader import pack
+
+try:
+    from importlib.util import MAGIC_NUMBER as PYC_MAGIC
+except ImportError:
+    import imp
+    PYC_MAGIC = imp.get_magic()
+
+# extension modules a frozen program commonly loads from next to the executable
+EXTENSIONS = ["math", "_struct", "time", "operator", "itertools", "_collections", "binascii",
+              "select", "_socket", "array", "cStringIO", "_random", "_heapq", "datetime"]
+
+MODULE_SOURCE = '''
+"""synthetic module %(n)d"""
+
+CONSTANTS = dict((k, k * %(n)d) for k in range(32))
+
+
+class Thing%(n)d(object):
+    def __init__(self, value):
+        self.value = value
+
+    def scaled(self, factor=%(n)d):
+        return [self.value * factor + c for c in CONSTANTS.values()]
+
+    def __repr__(self):
+        return "Thing%(n)d(%%r)" %% (self.value,)
+
+
+def helper_a(x):
+    return sorted(set(x))[:%(n)d %% 7 + 1]
+
+
+def helper_b(*args, **kwargs):
+    return len(args) + len(kwargs) + %(n)d
+'''
+
+
+def pyc(source, filename):
+    code = compile(source, filename, "exec")
+    header = PYC_MAGIC + struct.pack("<I", int(time.time()))
+    if sys.version_info >= (3, 7):
+        header = PYC_MAGIC + struct.pack("<III", 0, int(time.time()), len(source))
+    elif sys.version_info >= (3, 3):
+        header += struct.pack("<I", len(source))
+    return header + marshal.dumps(code)
+
+
+def module_names(count):
+    """dotted names of count modules, in packages of 100 beyond 100"""
+    if count <= 100:
+        return ["mod%05d" % i for i in range(count)]
+    return ["pkg%03d.mod%05d" % (i // 100, i) for i in range(count)]
+
+
+def find_extensions(names):
+    """paths of the shared objects implementing names, if they are not builtin"""
+    found = []
+    for name in names:
+        if name in sys.builtin_module_names:
+            continue
+        try:
+            mod = __import__(name)
+        except ImportError:
+            continue
+        path = getattr(mod, "__file__", None)
+        if path and os.path.splitext(path)[1] in (".so", ".pyd"):
+            found.append((name, path))
+    return found
+
+
+def freeze(directory, loader, modules, compression, extensions, fmt):
+    """write a frozen program to directory, return the list of its files"""
+    os.makedirs(directory)
+    names = module_names(modules)
+    exts = find_extensions(EXTENSIONS) if extensions else []
+
+    main = ["import sys"]
+    main += ["import %s" % (n,) for n in names]
+    main += ["import %s" % (n,) for n, _ in exts]
+    main.append("sys.exit(0)")
+
+    archive = os.path.join(directory, "library.zip")
+    method = zipfile.ZIP_DEFLATED if compression == "deflated" else zipfile.ZIP_STORED
+    with zipfile.ZipFile(archive, "w", method) as z:
+        z.writestr("__main__.pyc", pyc("\n".join(main) + "\n", "__main__.py"))
+        packages = sorted(set(n.split(".")[0] for n in names if "." in n))
+        for p in packages:
+            z.writestr(p + "/__init__.pyc", pyc("", p + "/__init__.py"))
+        for i, n in enumerate(names):
+            path = n.replace(".", "/")
+            z.writestr(path + ".pyc", pyc(MODULE_SOURCE % {"n": i}, path + ".py"))
+
+    if compression in pack.CODECS:
+        pack.compress(archive, compression)
+
+    exe = os.path.join(directory, "app")
+    files = [exe]
+    if fmt == "index":
+        pack.add_index(archive)
+    elif fmt == "pack":
+        flat = archive + ".pack"
+        pack.flatten(archive, flat)
+        os.rename(flat, archive)
+    if fmt == "single":
+        pack.add_index(archive)
+        pack.append_archive(loader, archive, exe)
+        os.remove(archive)
+    else:
+        shutil.copy2(loader, exe)
+        files.append(archive)
+
+    for name, path in exts:
+        dst = os.path.join(directory, os.path.basename(path))
+        shutil.copy2(path, dst)
+        files.append(dst)
+    return files
+
+
+def evict(paths, drop_caches):
+    """remove paths from the page cache, returns False if that's not possible"""
+    if drop_caches:
+        try:
+            subprocess.call(["sync"])
+            with open("/proc/sys/vm/drop_caches", "w") as f:
+                f.write("3\n")
+            return True
+        except (IOError, OSError):
+            pass
+
+    try:
+        import ctypes
+        import ctypes.util
+        libc = ctypes.CDLL(ctypes.util.find_library("c") or None, use_errno=True)
+        fadvise = libc.posix_fadvise
+    except (ImportError, OSError, AttributeError):
+        return False
+    fadvise.argtypes = [ctypes.c_int, ctypes.c_longlong, ctypes.c_longlong, ctypes.c_int]
+    POSIX_FADV_DONTNEED = 4
+    for p in paths:
+        fd = os.open(p, os.O_RDONLY)
+        try:
+            # dirty pages can't be dropped
+            os.fsync(fd)
+            if fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) != 0:
+                return False
+        finally:
+            os.close(fd)
+    return True
+
+
+def run_once(exe):
+    """run exe, return (wall seconds, rusage)"""
+    with open(os.devnull, "wb") as null:
+        start = clock()
+        pid = os.fork()
+        if pid == 0:
+            try:
+                os.dup2(null.fileno(), 1)
+                os.execv(exe, [exe])
+            finally:
+                os._exit(127)
+        _, status, usage = os.wait4(pid, 0)
+        wall = clock() - start
+    if not os.WIFEXITED(status) or os.WEXITSTATUS(status) != 0:
+        raise RuntimeError("%s failed with status %d" % (exe, status))
+    return wall, usage
+
+
+def count_syscalls(exe, runs):
+    """median number of system calls of exe according to strace, or None"""
+    counts = []
+    for _ in range(runs):
+        out = tempfile.mktemp()
+        try:
+            with open(os.devnull, "wb") as null:
+                err = subprocess.call(["strace", "-f", "-c", "-o", out, exe],
+                                      stdout=null, stderr=null)
+        except OSError as e:
+            if e.errno == errno.ENOENT:
+                return None
+            raise
+        if err != 0 or not os.path.exists(out):
+            return None
+        with open(out) as f:
+            for line in f:
+                fields = line.split()
+                if fields and fields[-1] == "total":
+                    counts.append(int(fields[3]))
+        os.remove(out)
+    return stats(counts) if counts else None
+
+
+def percentile(values, p):
+    values = sorted(values)
+    k = max(0, min(len(values) - 1, int(-(-p * len(values) // 100)) - 1))
+    return values[k]
+
+
+def stats(values):
+    return {
+        "median": percentile(values, 50),
+        "p99": percentile(values, 99),
+        "min": min(values),
+        "max": max(values),
+    }
+
+
+def measure(files, runs, cold, drop_caches):
+    exe = files[0]
+    walls, minflt, majflt, maxrss = [], [], [], []
+    run_once(exe)
+    for _ in range(runs):
+        if cold and not evict(files, drop_caches):
+            return None
+        wall, usage = run_once(exe)
+        walls.append(wall * 1000.0)
+        minflt.append(usage.ru_minflt)
+        majflt.append(usage.ru_majflt)
+        maxrss.append(usage.ru_maxrss)
+    return {
+        "wall_ms": stats(walls),
+        "minflt": stats(minflt),
+        "majflt": stats(majflt),
+        "maxrss_kb": stats(maxrss),
+    }
+
+
+def file_digest(path):
+    h = hashlib.sha256()
+    with open(path, "rb") as f:
+        h.update(f.read())
+    return h.hexdigest()
+
+
+def default_loader():
+    root = os.path.dirname(HERE)
+    candidates = glob.glob(os.path.join(root, "build", "*", "_ccfreeze_loader", "console.exe"))
+    return candidates[0] if candidates else None
+
+
+def run(args):
+    loader = os.path.abspath(args.loader or default_loader() or "")
+    if not os.path.isfile(loader):
+        raise SystemExit("no loader found, build it with 'python setup.py build_ext' or use --loader")
+
+    results = []
+    workdir = tempfile.mkdtemp(prefix="ccfreeze-bench-")
+    try:
+        for modules in args.modules:
+            for compression in args.compression:
+                for extensions in args.extensions:
+                    for fmt in args.formats:
+                        name = "%d-%s-%s-%s" % (modules, compression,
+                                                "ext" if extensions else "noext", fmt)
+                        files = freeze(os.path.join(workdir, name), loader, modules,
+                                       compression, extensions, fmt)
+                        for mode in args.modes:
+                            r = measure(files, args.runs, mode == "cold", args.drop_caches)
+                            if r is None:
+                                sys.stderr.write("%s: can't evict files from the page cache, "
+                                                 "skipping cold runs\n" % (name,))
+                                continue
+                            if mode == "warm" and args.syscall_runs:
+                                r["syscalls"] = count_syscalls(files[0], args.syscall_runs)
+                            r.update({
+                                "name": name, "modules": modules, "compression": compression,
+                                "extensions": extensions, "format": fmt, "mode": mode,
+                                "runs": args.runs,
+                                "disk_bytes": sum(os.path.getsize(f) for f in files),
+                            })
+                            results.append(r)
+                            sys.stderr.write("%-32s %-4s median %.2f ms  p99 %.2f ms\n" % (
+                                name, mode, r["wall_ms"]["median"], r["wall_ms"]["p99"]))
+    finally:
+        shutil.rmtree(workdir, ignore_errors=True)
+
+    doc = {
+        "loader": loader,
+        "loader_sha256": file_digest(loader),
+        "python": sys.version.split()[0],
+        "platform": platform.platform(),
+        "cpus": os.sysconf("SC_NPROCESSORS_ONLN"),
+        "time": int(time.time()),
+        "results": results,
+    }
+    text = json.dumps(doc, indent=1, sort_keys=True)
+    if args.output:
+        with open(args.output, "w") as f:
+            f.write(text + "\n")
+    else:
+        print(text)
+
+
+def compare(args):
+    with open(args.old) as f:
+        old = dict(((r["name"], r["mode"]), r) for r in json.load(f)["results"])
+    with open(args.new) as f:
+        new = json.load(f)["results"]
+    metrics = ["wall_ms", "minflt", "majflt", "maxrss_kb", "syscalls"]
+    print("%-32s %-4s %s" % ("benchmark", "mode", "  ".join("%10s" % m for m in metrics)))
+    for r in new:
+        o = old.get((r["name"], r["mode"]))
+        if not o:
+            continue
+        cols = []
+        for m in metrics:
+            a, b = o.get(m), r.get(m)
+            if a and b and a["median"]:
+                cols.append("%10.3f" % (float(b["median"]) / a["median"]))
+            else:
+                cols.append("%10s" % "-")
+        print("%-32s %-4s %s" % (r["name"], r["mode"], "  ".join(cols)))
+
+
+def main(argv=None):
+    import argparse
+
+    if argv is None:
+        argv = sys.argv[1:]
+    if argv[:1] == ["compare"]:
+        parser = argparse.ArgumentParser(prog="startup.py compare",
+                                         description="ratio new/old of the medians")
+        parser.add_argument("old")
+        parser.add_argument("new")
+        compare(parser.parse_args(argv[1:]))
+        return 0
+
+    def int_list(s):
+        return [int(x) for x in s.split(",")]
+
+    def str_list(s):
+        return s.split(",")
+
+    parser = argparse.ArgumentParser(prog="startup.py", description=__doc__.split("\n")[0])
+    parser.add_argument("--loader", help="console.exe to measure (default: the one in build/)")
+    parser.add_argument("--modules", type=int_list, default=[10, 1000, 10000],
+                        help="comma separated numbers of modules (default: 10,1000,10000)")
+    parser.add_argument("--compression", type=str_list, default=["stored", "deflated"],
+                        help="stored,deflated,zstd,lz4 (default: stored,deflated). zstd "
+                        "and lz4 need a loader built with them, and no pack format")
+    parser.add_argument("--extensions", type=lambda s: [x == "yes" for x in s.split(",")],
+                        default=[False, True], help="without and with C extensions: no,yes")
+    parser.add_argument("--formats", type=str_list, default=["zip"],
+                        help="archive formats: zip,index,pack,single (default: zip)")
+    parser.add_argument("--modes", type=str_list, default=["warm", "cold"], help="warm,cold")
+    parser.add_argument("--runs", type=int, default=50, help="runs per benchmark (default: 50)")
+    parser.add_argument("--syscall-runs", type=int, default=3,
+                        help="runs under strace per benchmark, 0 to skip (default: 3)")
+    parser.add_argument("--drop-caches", action="store_true",
+                        help="drop the whole page cache for cold runs (needs root)")
+    parser.add_argument("-o", "--output", help="write the JSON results here")
+    run(parser.parse_args(argv))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
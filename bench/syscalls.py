@@ -0,0 +1,153 @@
+"""check the loader's startup against its system call budget
+
+usage: python bench/syscalls.py [--loader build/.../console.exe] [options]
+
+Freezes a small program (see startup.py) and runs it under strace -f with
+CCFREEZE_PHASE_MARKERS set, so that the loader brackets each startup phase
+with marker calls (see report.h). The run fails if
+
+- Py_Initialize, the calls between its markers in every thread, makes
+  more than --initialize-calls system calls of any kind,
+- the whole run makes more than --readlinks readlink() calls, one for
+  /proc/self/exe and one for a realpath(): a frozen executable resolved
+  through /proc/self/exe must not search for a Python prefix (see
+  getpath.c),
+- or it touches any of the landmarks the stock search probes for (os.py,
+  lib-dynload, Modules/Setup, ...).
+
+Prints the offending calls and exits with 1 over budget, with 77 if strace
+is not installed, like a skipped automake test, and with 0 otherwise.
+"""
+
+from __future__ import print_function
+
+import os
+import re
+import sys
+import shutil
+import subprocess
+import tempfile
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+sys.path.insert(0, HERE)
+
+import startup
+
+# paths the stock getpath.c probes while looking for prefix and exec_prefix
+LANDMARKS = re.compile(r"(/os\.py[co]?|/lib-dynload|/Modules/Setup|/lib/python\d\.\d+)(\"|/|$)")
+
+# pid? syscall(args) = result, or the first half of a call strace -f
+# interrupted to show another thread's, the "<... resumed>" half is skipped
+CALL = re.compile(r'^(?:\[pid\s+\d+\]\s+|\d+\s+)?(\w+)\((.*)(?:\)\s+=\s+(-?\w+)'
+                  r'|\s*<unfinished \.\.\.>$)')
+
+# the loader's phase markers, see report.h
+MARKER = "/ccfreeze-phase/%s/%s"
+
+
+def parse(lines):
+    """(syscall, first path argument, result) of each complete strace line"""
+    calls = []
+    for line in lines:
+        m = CALL.match(line)
+        if not m:
+            continue
+        path = re.search(r'"((?:[^"\\]|\\.)*)"', m.group(2))
+        calls.append((m.group(1), path.group(1) if path else "", m.group(3) or "?"))
+    return calls
+
+
+def phase(calls, name):
+    """the calls between the markers of phase name, None without markers"""
+    paths = [c[1] for c in calls]
+    try:
+        begin = paths.index(MARKER % ("begin", name))
+        end = paths.index(MARKER % ("end", name), begin)
+    except ValueError:
+        return None
+    return calls[begin + 1:end]
+
+
+def check(calls, readlinks, initialize_calls):
+    """return the list of problems, empty if calls are within budget"""
+    problems = []
+    init = phase(calls, "Py_Initialize")
+    if init is None:
+        problems.append("no Py_Initialize markers, the loader predates CCFREEZE_PHASE_MARKERS")
+    elif len(init) > initialize_calls:
+        problems.append("%d system calls in Py_Initialize, the budget is %d:"
+                        % (len(init), initialize_calls))
+        counts = {}
+        for c in init:
+            counts[c[0]] = counts.get(c[0], 0) + 1
+        problems += ["  %5d %s" % (n, name) for name, n in
+                     sorted(counts.items(), key=lambda x: (-x[1], x[0]))]
+    links = [c for c in calls if c[0] in ("readlink", "readlinkat")]
+    if len(links) > readlinks:
+        problems.append("%d readlink calls, the budget is %d:" % (len(links), readlinks))
+        problems += ["  %s(%s) = %s" % c for c in links]
+    for c in calls:
+        if LANDMARKS.search(c[1]):
+            problems.append("prefix search: %s(%s) = %s" % c)
+    return problems
+
+
+def trace(exe):
+    """strace output of a run of exe, None if there is no strace"""
+    out = tempfile.mktemp()
+    env = dict(os.environ, CCFREEZE_PHASE_MARKERS="1")
+    try:
+        with open(os.devnull, "wb") as null:
+            err = subprocess.call(["strace", "-f", "-o", out, exe], stdout=null, stderr=null,
+                                  env=env)
+    except OSError:
+        return None
+    try:
+        if err != 0:
+            raise SystemExit("%s failed under strace with status %d" % (exe, err))
+        with open(out) as f:
+            return f.readlines()
+    finally:
+        if os.path.exists(out):
+            os.remove(out)
+
+
+def main(argv=None):
+    import argparse
+
+    parser = argparse.ArgumentParser(prog="syscalls.py", description=__doc__.split("\n")[0])
+    parser.add_argument("--loader", help="console.exe to check (default: the one in build/)")
+    parser.add_argument("--formats", type=lambda s: s.split(","), default=["index", "single"],
+                        help="archive formats to check: zip,index,pack,single "
+                        "(default: index,single)")
+    parser.add_argument("--initialize-calls", type=int, default=100,
+                        help="system calls allowed in Py_Initialize (default: %(default)s)")
+    parser.add_argument("--readlinks", type=int, default=2,
+                        help="readlink calls allowed (default: %(default)s)")
+    args = parser.parse_args(argv)
+
+    loader = os.path.abspath(args.loader or startup.default_loader() or "")
+    if not os.path.isfile(loader):
+        raise SystemExit("no loader found, build it with 'python setup.py build_ext' or use --loader")
+
+    failed = False
+    workdir = tempfile.mkdtemp(prefix="ccfreeze-syscalls-")
+    try:
+        for fmt in args.formats:
+            files = startup.freeze(os.path.join(workdir, fmt), loader, 10, "deflated", False, fmt)
+            lines = trace(files[0])
+            if lines is None:
+                sys.stderr.write("strace is not installed, skipping\n")
+                return 77
+            problems = check(parse(lines), args.readlinks, args.initialize_calls)
+            print("%-8s %s" % (fmt, "over budget" if problems else "ok"))
+            for p in problems:
+                print("  " + p)
+            failed = failed or bool(problems)
+    finally:
+        shutil.rmtree(workdir, ignore_errors=True)
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -2,11 +2,13 @@
 
 # setup.py adapted from py2exe's setup.py
 
-import sys, os, struct, platform
+import sys, os, json, math, struct, platform, subprocess
 
 from setuptools import setup, Extension
 
 from distutils.command import build_ext
+from distutils.dir_util import remove_tree
+from distutils.errors import DistutilsOptionError
 from distutils import sysconfig
 
 
@@ -21,6 +23,8 @@ os.environ['LD_RUN_PATH'] = "${ORIGIN}:${ORIGIN}/../lib"
 
 conf = None
 
+BENCHMARK = os.path.join(os.path.dirname(os.path.abspath(__file__)), "bench", "startup.py")
+
 
 class Conf(object):
     def __init__(self):
@@ -30,6 +34,9 @@ class Conf(object):
         self.unix = not (self.darwin or self.win32)  # other unix
         VERSION = sysconfig.get_config_var("VERSION")
         self.static_library = self._static_library()
+        self.zlib = self._find_library("zlib.h", "z", "inflate")
+        self.zstd = self._find_library("zstd.h", "zstd", "ZSTD_decompressDCtx")
+        self.lz4 = self._find_library("lz4.h", "lz4", "LZ4_decompress_safe_usingDict")
         VERSIONM = "%s%s" % (VERSION, 'm')
         if VERSION:
             if sys.version_info <= (3,0):
@@ -65,6 +72,49 @@ class Conf(object):
             return p
         return ""
 
+    def _find_header(self, name):
+        if self.win32:
+            return ""
+        dirs = [sysconfig.get_config_var("INCLUDEDIR"), "/usr/local/include", "/usr/include"]
+        for d in dirs:
+            if d and os.path.exists(os.path.join(d, name)):
+                return os.path.join(d, name)
+        return ""
+
+    def _find_library(self, header, lib, func):
+        """the path of header if the loader can be built with it, "" if it is
+        missing, exits if header is there but lib does not link"""
+        path = self._find_header(header)
+        if path and not self._links(path, lib, func):
+            sys.exit("error: %s is installed, but a program calling %s does not link with -l%s"
+                     % (path, func, lib))
+        return path
+
+    def _links(self, header, lib, func):
+        from distutils.ccompiler import new_compiler
+        from distutils.errors import CCompilerError, DistutilsExecError
+        import shutil, tempfile
+
+        tmp = tempfile.mkdtemp(prefix="ccfreeze-conf-")
+        try:
+            src = os.path.join(tmp, "conf.c")
+            with open(src, "w") as f:
+                f.write("#include <%s>\nint main(void) { return (int)(long)&%s; }\n"
+                        % (os.path.basename(header), func))
+            cc = new_compiler()
+            sysconfig.customize_compiler(cc)
+            libdir = os.path.join(os.path.dirname(os.path.dirname(header)), "lib")
+            try:
+                objs = cc.compile([src], output_dir=tmp,
+                                  include_dirs=[os.path.dirname(header)])
+                cc.link_executable(objs, "conf", output_dir=tmp, libraries=[lib],
+                                   library_dirs=[libdir])
+            except (CCompilerError, DistutilsExecError):
+                return False
+            return True
+        finally:
+            shutil.rmtree(tmp, ignore_errors=True)
+
     def __repr__(self):
         d = self.__dict__.copy()
         d['sys.version'] = sys.version
@@ -98,9 +148,174 @@ def maybe_strip(exe):
         sys.stdout.write("strip command failed\n")
 
 
+def strip_rpath(args):
+    """remove run path options from a list of linker arguments"""
+    return [a for a in args if not a.startswith(('-Wl,-rpath', '-Wl,-R'))]
+
+
+def find_frozen_modules(names, path=None):
+    """return [(module name, source file, is package)] for names
+
+    a package brings all of its submodules: python 2 imports nothing but
+    frozen modules from a frozen package.
+    """
+    import imp
+    import pkgutil
+
+    res = []
+    seen = set()
+
+    def add(name, search, required):
+        if name in seen:
+            return
+        seen.add(name)
+        base = name.rpartition('.')[2]
+        f, pathname, (suffix, mode, kind) = imp.find_module(base, search)
+        if f:
+            f.close()
+        if kind == imp.PKG_DIRECTORY:
+            res.append((name, os.path.join(pathname, '__init__.py'), True))
+            for _, sub, _ in pkgutil.iter_modules([pathname]):
+                try:
+                    add(name + '.' + sub, [pathname], False)
+                except ImportError:
+                    pass
+        elif kind == imp.PY_SOURCE:
+            res.append((name, pathname, False))
+        elif required:
+            raise ImportError("%s is not a python source module" % (name,))
+
+    for name in names:
+        search = path
+        parts = name.split('.')
+        for i in range(1, len(parts)):
+            f, search, _ = imp.find_module(parts[i - 1], search)
+            search = [search]
+        add(name, search, True)
+    return res
+
+
+def write_frozen_modules(output, modules):
+    """write a C file defining ccf_frozen_modules for PyImport_FrozenModules"""
+    import marshal
+
+    out = ["// generated by setup.py build_ext --frozen-modules, do not edit",
+           "",
+           "#include <Python.h>",
+           ""]
+    table = []
+    for i, (name, source, package) in enumerate(modules):
+        with open(source, 'rb') as f:
+            text = f.read()
+        rel = name.replace('.', '/') + ('/__init__.py' if package else '.py')
+        data = bytearray(marshal.dumps(compile(text.replace(b'\r\n', b'\n'), rel, 'exec')))
+        out.append("// %s" % (name,))
+        out.append("static unsigned char M_%d[] = {" % (i,))
+        for j in range(0, len(data), 16):
+            out.append("\t" + "".join("%d," % c for c in data[j:j + 16]))
+        out.append("};")
+        # a negative size marks a package
+        table.append('\t{"%s", M_%d, %s%d},' % (name, i, '-' if package else '', len(data)))
+    out.append("")
+    out.append("struct _frozen ccf_frozen_modules[] = {")
+    out.extend(table)
+    out.append("\t{0, 0, 0}")
+    out.append("};")
+    out.append("")
+    with open(output, 'w') as f:
+        f.write("\n".join(out))
+
+
+def write_static_extensions(output, names):
+    """write a C file defining ccf_static_extensions for PyImport_ExtendInittab"""
+    out = ["// generated by setup.py build_ext --static-extensions, do not edit",
+           "",
+           "#include <Python.h>",
+           ""]
+    for name in names:
+        out.append("extern void init%s(void);" % (name.rpartition('.')[2],))
+    out.append("")
+    out.append("struct _inittab ccf_static_extensions[] = {")
+    for name in names:
+        out.append('\t{"%s", init%s},' % (name, name.rpartition('.')[2]))
+    out.append("\t{0, 0}")
+    out.append("};")
+    out.append("")
+    with open(output, 'w') as f:
+        f.write("\n".join(out))
+
+
 class BuildInterpreters(build_ext.build_ext):
     _patched = False
 
+    user_options = build_ext.build_ext.user_options + [
+        ('frozen-modules=', None,
+         "comma separated python modules to compile into the loaders, "
+         "packages with all of their submodules"),
+        ('frozen-path=', None,
+         "directories to look for frozen modules in before sys.path"),
+        ('static-extensions=', None,
+         "comma separated C extensions to link into the loaders, as module "
+         "or module=object, where object is a .o file or a static library "
+         "providing the module's init function"),
+        ('static', None,
+         "link the loaders statically, with a static libpython and no "
+         "dynamic loader; C extensions have to be linked in with "
+         "--static-extensions"),
+        ('static-pie', None,
+         "like --static, as a position independent executable"),
+        ('pgo', None,
+         "build the loaders with profile guided and link time optimization "
+         "(gcc only): "
+         "build them instrumented, train them and build them again with the "
+         "profile, then report the speedup measured by bench/startup.py"),
+        ('pgo-workload=', None,
+         "shell command training the instrumented loader, which is in "
+         "$CCFREEZE_LOADER (default: bench/startup.py on synthetic programs)"),
+        ]
+
+    boolean_options = build_ext.build_ext.boolean_options + ['static', 'static-pie', 'pgo']
+
+    def initialize_options(self):
+        build_ext.build_ext.initialize_options(self)
+        self.frozen_modules = None
+        self.frozen_path = None
+        self.static_extensions = None
+        self.static_objects = []
+        self.static = 0
+        self.static_pie = 0
+        self.pgo = 0
+        self.pgo_workload = None
+        self.pgo_args = []
+
+    def finalize_options(self):
+        build_ext.build_ext.finalize_options(self)
+        if isinstance(self.frozen_modules, str):
+            self.frozen_modules = [m.strip() for m in self.frozen_modules.split(',') if m.strip()]
+        if isinstance(self.frozen_path, str):
+            self.frozen_path = self.frozen_path.split(os.pathsep)
+        if isinstance(self.static_extensions, str):
+            names = []
+            objects = []
+            for spec in self.static_extensions.split(','):
+                name, _, obj = spec.strip().partition('=')
+                if name and name not in names:
+                    names.append(name)
+                if obj:
+                    objects.append(obj)
+            self.static_extensions = names
+            self.static_objects = objects
+        if self.static_pie:
+            self.static = 1
+        if self.static and not (conf.unix and conf.static_library):
+            raise DistutilsOptionError("--static needs linux and a static libpython")
+        if self.pgo and not self._gcc():
+            # clang's profiles need an llvm-profdata merge step, which the
+            # build does not run
+            raise DistutilsOptionError("--pgo needs gcc")
+        if self.pgo and not (self.pgo_workload or os.path.exists(BENCHMARK)):
+            raise DistutilsOptionError("--pgo needs %s or --pgo-workload" % (BENCHMARK,))
+
     def get_ext_filename(self, ext_name):
         r"""Convert the name of an extension (eg. "foo.bar") into the name
         of the file from which it will be loaded (eg. "foo/bar.so", or
@@ -124,11 +339,20 @@ class BuildInterpreters(build_ext.build_ext):
         LINKFORSHARED = sysconfig.get_config_var("LINKFORSHARED")
         if LINKFORSHARED and sys.platform != 'darwin':
             linker = " ".join([sysconfig.get_config_var(x) for x in 'LINKCC LDFLAGS LINKFORSHARED'.split()])
+            if self.static:
+                # nothing is going to be dlopen()ed: no dynamic symbols
+                linker = " ".join([sysconfig.get_config_var(x) for x in 'LINKCC LDFLAGS'.split()])
+                linker += ' -static-pie' if self.static_pie else ' -static'
             if '-Xlinker' in linker:
                 linker += ' -Xlinker -zmuldefs'
                 linker += ' -Xlinker --disable-new-dtags'
                 linker += ' -v'
             LOCALMODLIBS = sysconfig.get_config_var("LOCALMODLIBS") or ""
+            if self.static:
+                # there is no ld.so to use it, and a static-pie with a
+                # run path crashes while relocating itself
+                linker = " ".join(strip_rpath(linker.split()))
+                os.environ.pop('LD_RUN_PATH', None)
 
             self.compiler.set_executables(linker_exe=linker)
 
@@ -141,6 +365,10 @@ class BuildInterpreters(build_ext.build_ext):
 
             if LOCALMODLIBS:
                 kwargs["extra_postargs"] = LOCALMODLIBS.split()
+            if self.pgo_args:
+                kwargs["extra_preargs"] = self.pgo_args + (kwargs.get("extra_preargs") or [])
+            if self.static and kwargs.get("extra_postargs"):
+                kwargs["extra_postargs"] = strip_rpath(kwargs["extra_postargs"])
 
             retval = self.compiler.link_executable(*args, **kwargs)
             maybe_strip(args[1])
@@ -150,9 +378,150 @@ class BuildInterpreters(build_ext.build_ext):
 
         self._patched = True
 
+    def _add_frozen_modules(self, ext):
+        if not self.frozen_modules:
+            return
+        path = None
+        if self.frozen_path:
+            path = self.frozen_path + sys.path
+        modules = find_frozen_modules(self.frozen_modules, path)
+        output = os.path.join(self.build_temp, "frozen_modules.c")
+        self.mkpath(self.build_temp)
+        sys.stdout.write("====> Freezing %d modules into %s\n" % (len(modules), output))
+        write_frozen_modules(output, modules)
+        if output not in ext.sources:
+            ext.sources.append(output)
+        if ('CCF_FROZEN_MODULES', 1) not in ext.define_macros:
+            ext.define_macros.append(('CCF_FROZEN_MODULES', 1))
+
+    def _add_static_extensions(self, ext):
+        if not self.static_extensions:
+            return
+        output = os.path.join(self.build_temp, "static_extensions.c")
+        self.mkpath(self.build_temp)
+        write_static_extensions(output, self.static_extensions)
+        if output not in ext.sources:
+            ext.sources.append(output)
+        # before a static libpython, which they need
+        ext.extra_objects[0:0] = [o for o in self.static_objects if o not in ext.extra_objects]
+        if ('CCF_STATIC_EXTENSIONS', 1) not in ext.define_macros:
+            ext.define_macros.append(('CCF_STATIC_EXTENSIONS', 1))
+
+    def _static_link(self, ext):
+        if not self.static:
+            return
+        if conf.PYTHONVERSION in ext.libraries:
+            ext.libraries = [l for l in ext.libraries if l != conf.PYTHONVERSION]
+        # after the static extensions, which need it
+        if conf.static_library not in ext.extra_objects:
+            ext.extra_objects.append(conf.static_library)
+        if ('CCF_STATIC_LINK', 1) not in ext.define_macros:
+            ext.define_macros.append(('CCF_STATIC_LINK', 1))
+
+    def _build_with(self, ext, args):
+        # the same objects with other flags: build them again
+        compile_args = ext.extra_compile_args
+        self.pgo_args = args
+        ext.extra_compile_args = compile_args + args
+        force, self.force = self.force, 1
+        try:
+            build_ext.build_ext.build_extension(self, ext)
+        finally:
+            self.force = force
+            ext.extra_compile_args = compile_args
+            self.pgo_args = []
+
+    def _gcc(self):
+        if conf.win32:
+            return False
+        cc = (os.environ.get("CC") or sysconfig.get_config_var("CC") or "cc").split()
+        try:
+            version = subprocess.check_output(cc[:1] + ["--version"]).decode("utf-8", "replace")
+        except (OSError, subprocess.CalledProcessError):
+            return False
+        return "clang" not in version and "Free Software Foundation" in version
+
+    def _pgo_benchmark(self, exe, runs, output):
+        """{benchmark name: (median, p99)} of the wall times in ms"""
+        subprocess.check_call([sys.executable, BENCHMARK, "--loader", exe,
+                               "--modules", "10,1000", "--extensions", "no",
+                               "--modes", "warm", "--runs", str(runs),
+                               "--syscall-runs", "0", "-o", output])
+        with open(output) as f:
+            return dict((r["name"], (r["wall_ms"]["median"], r["wall_ms"]["p99"]))
+                        for r in json.load(f)["results"])
+
+    def _build_pgo(self, ext):
+        exe = os.path.abspath(self.get_ext_fullpath(ext.name))
+        temp = os.path.abspath(self.build_temp)
+        profile = os.path.join(temp, "pgo")
+
+        sys.stdout.write("====> PGO: building %s as before\n" % (exe,))
+        self._build_with(ext, [])
+        before = self._pgo_benchmark(exe, 30, os.path.join(temp, "pgo-before.json"))
+
+        sys.stdout.write("====> PGO: training the instrumented loader\n")
+        if os.path.exists(profile):
+            remove_tree(profile, dry_run=self.dry_run)
+        # the prefetch threads run loader code too
+        self._build_with(ext, ["-fprofile-generate=" + profile, "-fprofile-update=prefer-atomic"])
+        if self.pgo_workload:
+            env = dict(os.environ, CCFREEZE_LOADER=exe)
+            subprocess.check_call(self.pgo_workload, shell=True, env=env)
+        else:
+            self._pgo_benchmark(exe, 5, os.path.join(temp, "pgo-training.json"))
+
+        sys.stdout.write("====> PGO: building with the profile and -flto\n")
+        # fat objects: libccfreeze_loader.a links without -flto too
+        self._build_with(ext, ["-fprofile-use=" + profile, "-fprofile-correction",
+                               "-Wno-missing-profile", "-flto", "-ffat-lto-objects"])
+        after = self._pgo_benchmark(exe, 30, os.path.join(temp, "pgo-after.json"))
+
+        ratios = []
+        noisy = []
+        for name in sorted(before):
+            if name in after and before[name][0]:
+                ratios.append(after[name][0] / before[name][0])
+                sys.stdout.write("====> PGO: %-28s %8.2f ms -> %8.2f ms\n"
+                                 % (name, before[name][0], after[name][0]))
+                # PGO does not make a program twice as fast or as slow
+                if (max(before[name][1] / before[name][0], after[name][1] / after[name][0]) > 1.5
+                        or not 0.67 < ratios[-1] < 1.5):
+                    noisy.append(name)
+        if ratios:
+            mean = math.exp(sum(math.log(r) for r in ratios) / len(ratios))
+            sys.stdout.write("====> PGO: startup %.1f%% %s (geometric mean)\n"
+                             % (abs(1 - mean) * 100, "faster" if mean <= 1 else "slower"))
+        if noisy:
+            sys.stdout.write("====> PGO: warning: the timings of %s are too noisy to compare, "
+                             "benchmark again on a quiet machine\n" % (", ".join(noisy),))
+
+    def _build_library(self, ext):
+        """libccfreeze_loader.a: the objects of ext without main(), see embed.h"""
+        sources = [s for s in ext.sources if os.path.basename(s) != 'console.c']
+        objects = self.compiler.object_filenames(sources, output_dir=self.build_temp)
+        objects += self.compiler.compile(['_ccfreeze_loader/embed.c'],
+                                         output_dir=self.build_temp,
+                                         macros=ext.define_macros,
+                                         include_dirs=ext.include_dirs,
+                                         debug=self.debug,
+                                         extra_postargs=ext.extra_compile_args)
+        output_dir = os.path.dirname(self.get_ext_fullpath(ext.name))
+        self.compiler.create_static_lib(objects, 'ccfreeze_loader', output_dir=output_dir,
+                                        debug=self.debug)
+        self.copy_file('_ccfreeze_loader/embed.h', output_dir)
+
     def build_extension(self, ext):
         self._patch()
-        return build_ext.build_ext.build_extension(self, ext)
+        self._add_frozen_modules(ext)
+        self._add_static_extensions(ext)
+        self._static_link(ext)
+        if self.pgo:
+            self._build_pgo(ext)
+        else:
+            build_ext.build_ext.build_extension(self, ext)
+        if conf.unix and ext.name == '_ccfreeze_loader/console':
+            self._build_library(ext)
 
 long_description = """ccfreeze-loader provides binary dependencies for
 ccfreeze. please do not install this module, install ccfreeze
@@ -202,7 +571,37 @@ def main():
     if sys.platform == 'win32':
         define_macros.append(('WIN32', 1))
     else:
+        extra_sources.append('_ccfreeze_loader/alloc.c')
+        extra_sources.append('_ccfreeze_loader/batch.c')
+        extra_sources.append('_ccfreeze_loader/gcfreeze.c')
         extra_sources.append('_ccfreeze_loader/getpath.c')
+        extra_sources.append('_ccfreeze_loader/archive.c')
+        extra_sources.append('_ccfreeze_loader/extension.c')
+        extra_sources.append('_ccfreeze_loader/importer.c')
+        extra_sources.append('_ccfreeze_loader/options.c')
+        extra_sources.append('_ccfreeze_loader/prefetch.c')
+        extra_sources.append('_ccfreeze_loader/record.c')
+        extra_sources.append('_ccfreeze_loader/report.c')
+        extra_sources.append('_ccfreeze_loader/shmcache.c')
+        extra_sources.append('_ccfreeze_loader/trace.c')
+        extra_sources.append('_ccfreeze_loader/zygote.c')
+        if conf.zlib:
+            define_macros.append(('WITH_ZLIB', 1))
+            libs.append('z')
+        if conf.zstd:
+            define_macros.append(('WITH_ZSTD', 1))
+            libs.append('zstd')
+        if conf.lz4:
+            define_macros.append(('WITH_LZ4', 1))
+            libs.append('lz4')
+        codecs = [("deflate", conf.zlib, "zlib.h"), ("zstd", conf.zstd, "zstd.h"),
+                  ("lz4", conf.lz4, "lz4.h")]
+        sys.stdout.write("====> compression methods built in: %s\n"
+                         % ", ".join(["stored"] + [n for n, found, h in codecs if found]))
+        for n, found, h in codecs:
+            if not found:
+                sys.stdout.write("====> %s left out, %s not found: archives compressed with it "
+                                 "won't load\n" % (n, h))
 
     if sys.platform == 'win32':
         extra_link_args = ['/LARGEADDRESSAWARE']